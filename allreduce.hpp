@@ -0,0 +1,345 @@
+#pragma once
+
+#include <fmt/format.h>
+#include <fmt/compile.h>
+#include <fmt/color.h>
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <span>
+#include <vector>
+#include <string>
+#include <cstring>
+#include <algorithm>
+
+
+// Provides elementwise summation of arrays of doubles across a group of cooperating processes (an all-reduce)
+//
+// A communicator is created in the first process before any others are forked from it.
+// Each process (including the first) then calls join with its rank in [0, process_count - 1], and thereafter
+// every process must make the same sequence of calls to sum with arrays of the same sizes.
+//
+// shm_communicator uses POSIX shared memory, and is intended for processes on one machine (eg: one per NUMA domain)
+// tcp_communicator uses sockets over the loopback interface, as a stand-in for communication between nodes
+
+
+class communicator
+{
+public:
+
+  communicator(const std::size_t process_count) noexcept
+    : size_(process_count)
+  {}
+
+  virtual ~communicator() = default;
+
+  communicator(const communicator&) = delete; // non-copyable and non-moveable
+
+  // called in each process once it has been created, with that process' rank
+  virtual void join(const std::size_t rank) = 0;
+
+  // sum data elementwise across all processes, leaving the result in data on every process
+  virtual void sum(std::span<double> data) = 0;
+
+  std::size_t rank() const noexcept
+  {
+    return rank_;
+  }
+
+  std::size_t size() const noexcept
+  {
+    return size_;
+  }
+
+protected:
+
+  std::size_t rank_{0};
+  std::size_t size_;
+};
+
+
+class shm_communicator : public communicator
+{
+public:
+
+  // capacity is the number of doubles each process can contribute per exchange (larger arrays are exchanged in pieces)
+  shm_communicator(const std::size_t process_count, const std::size_t capacity = 1 << 16)
+    : communicator(process_count), capacity_(capacity)
+  {
+    const std::string name{fmt::format("/allreduce_{}", getpid())};
+
+    const int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+
+    if (fd == -1)
+    {
+      fmt::print(fmt::emphasis::bold | fg(fmt::color::red), "ERROR: unable to create shared memory segment {}: {}\n", name, std::strerror(errno));
+
+      std::exit(EXIT_FAILURE);
+    }
+
+    bytes_ = sizeof(pthread_barrier_t) + size_ * capacity_ * sizeof(double);
+
+    if (ftruncate(fd, static_cast<off_t>(bytes_)) == -1)
+    {
+      fmt::print(fmt::emphasis::bold | fg(fmt::color::red), "ERROR: unable to size shared memory segment {} to {} bytes\n", name, bytes_);
+
+      std::exit(EXIT_FAILURE);
+    }
+
+    void* const mapping = mmap(nullptr, bytes_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+    ::close(fd);
+
+    // the mapping is inherited by forked processes, so the name is no longer needed (and the segment is freed automatically on exit)
+    shm_unlink(name.c_str());
+
+    if (mapping == MAP_FAILED)
+    {
+      fmt::print(fmt::emphasis::bold | fg(fmt::color::red), "ERROR: unable to map shared memory segment {}\n", name);
+
+      std::exit(EXIT_FAILURE);
+    }
+
+    barrier_ = static_cast<pthread_barrier_t*>(mapping);
+    slots_   = reinterpret_cast<double*>(static_cast<std::byte*>(mapping) + sizeof(pthread_barrier_t));
+
+    pthread_barrierattr_t attr;
+
+    pthread_barrierattr_init(&attr);
+    pthread_barrierattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+
+    pthread_barrier_init(barrier_, &attr, static_cast<unsigned>(size_));
+
+    pthread_barrierattr_destroy(&attr);
+  }
+
+  ~shm_communicator() override
+  {
+    munmap(barrier_, bytes_);
+  }
+
+  void join(const std::size_t rank) override
+  {
+    rank_ = rank;
+  }
+
+  void sum(std::span<double> data) override
+  {
+    for (std::size_t offset = 0; offset < data.size(); offset += capacity_)
+      sum_piece(data.subspan(offset, std::min(capacity_, data.size() - offset)));
+  }
+
+private:
+
+  double* slot(const std::size_t rank) const noexcept
+  {
+    return slots_ + rank * capacity_;
+  }
+
+  // reduce-scatter then all-gather through the shared slots: each process sums its own chunk across all slots into slot 0
+  void sum_piece(const std::span<double> data)
+  {
+    std::ranges::copy(data, slot(rank_));
+
+    pthread_barrier_wait(barrier_);
+
+    const std::size_t from = data.size() *  rank_      / size_;
+    const std::size_t to   = data.size() * (rank_ + 1) / size_;
+
+    for (std::size_t r = 1; r < size_; ++r)
+    {
+      const double* const src = slot(r);
+
+      double* const dest = slot(0);
+
+      for (std::size_t i = from; i < to; ++i)
+        dest[i] += src[i];
+    }
+
+    pthread_barrier_wait(barrier_);
+
+    std::copy_n(slot(0), data.size(), data.begin());
+
+    // prevent slot 0 being overwritten by the next exchange before all processes have read it
+    pthread_barrier_wait(barrier_);
+  }
+
+  std::size_t        capacity_;
+  std::size_t        bytes_;
+  pthread_barrier_t* barrier_;
+  double*            slots_;
+};
+
+
+class tcp_communicator : public communicator
+{
+public:
+
+  // rank 0 acts as a hub: it listens on a loopback port, receives every array, and sends back the sum
+  tcp_communicator(const std::size_t process_count)
+    : communicator(process_count)
+  {
+    listener_ = socket(AF_INET, SOCK_STREAM, 0);
+
+    sockaddr_in address{};
+
+    address.sin_family      = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port        = 0; // let the kernel pick a free port
+
+    socklen_t length = sizeof(address);
+
+    if (listener_ == -1
+        || bind(listener_, reinterpret_cast<sockaddr*>(&address), length) == -1
+        || listen(listener_, static_cast<int>(size_)) == -1
+        || getsockname(listener_, reinterpret_cast<sockaddr*>(&address), &length) == -1)
+    {
+      fmt::print(fmt::emphasis::bold | fg(fmt::color::red), "ERROR: unable to create loopback listener: {}\n", std::strerror(errno));
+
+      std::exit(EXIT_FAILURE);
+    }
+
+    port_ = address.sin_port;
+  }
+
+  ~tcp_communicator() override
+  {
+    for (const int fd : peers_)
+      ::close(fd);
+
+    if (listener_ != -1)
+      ::close(listener_);
+  }
+
+  void join(const std::size_t rank) override
+  {
+    rank_ = rank;
+
+    if (rank_ == 0)
+    {
+      peers_.resize(size_ - 1);
+
+      // peers may connect in any order, so each first announces its rank
+      for (std::size_t i = 1; i < size_; ++i)
+      {
+        const int fd = accept(listener_, nullptr, nullptr);
+
+        std::uint64_t peer_rank{0};
+
+        if (fd == -1 || !transfer<false>(fd, std::as_writable_bytes(std::span{&peer_rank, 1})) || peer_rank == 0 || peer_rank >= size_)
+        {
+          fmt::print(fmt::emphasis::bold | fg(fmt::color::red), "ERROR: failed to accept peer process {}\n", i);
+
+          std::exit(EXIT_FAILURE);
+        }
+
+        set_nodelay(fd);
+
+        peers_[peer_rank - 1] = fd;
+      }
+    }
+    else
+    {
+      ::close(listener_);
+
+      listener_ = -1;
+
+      const int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+      sockaddr_in address{};
+
+      address.sin_family      = AF_INET;
+      address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+      address.sin_port        = port_;
+
+      std::uint64_t own_rank{rank_};
+
+      if (fd == -1
+          || connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == -1
+          || !transfer<true>(fd, std::as_writable_bytes(std::span{&own_rank, 1})))
+      {
+        fmt::print(fmt::emphasis::bold | fg(fmt::color::red), "ERROR: process {} failed to connect to hub: {}\n", rank_, std::strerror(errno));
+
+        std::exit(EXIT_FAILURE);
+      }
+
+      set_nodelay(fd);
+
+      peers_.assign(1, fd);
+    }
+  }
+
+  void sum(std::span<double> data) override
+  {
+    const auto bytes = std::as_writable_bytes(data);
+
+    bool ok{true};
+
+    if (rank_ == 0)
+    {
+      buffer_.resize(data.size());
+
+      // sum in rank order so every run gives bitwise identical results
+      for (const int fd : peers_)
+      {
+        ok &= transfer<false>(fd, std::as_writable_bytes(std::span{buffer_}));
+
+        for (std::size_t i = 0; i < data.size(); ++i)
+          data[i] += buffer_[i];
+      }
+
+      for (const int fd : peers_)
+        ok &= transfer<true>(fd, bytes);
+    }
+    else
+    {
+      ok &= transfer<true >(peers_.front(), bytes);
+      ok &= transfer<false>(peers_.front(), bytes);
+    }
+
+    if (!ok)
+    {
+      fmt::print(fmt::emphasis::bold | fg(fmt::color::red), "ERROR: process {} lost its connection during an all-reduce\n", rank_);
+
+      std::exit(EXIT_FAILURE);
+    }
+  }
+
+private:
+
+  static void set_nodelay(const int fd) noexcept
+  {
+    const int one{1};
+
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  }
+
+  // send (or receive) exactly the given bytes
+  template<bool send>
+  static bool transfer(const int fd, std::span<std::byte> bytes) noexcept
+  {
+    while (!bytes.empty())
+    {
+      const auto done = send ? ::send(fd, bytes.data(), bytes.size(), MSG_NOSIGNAL) : ::recv(fd, bytes.data(), bytes.size(), 0);
+
+      if (done <= 0)
+        return false;
+
+      bytes = bytes.subspan(static_cast<std::size_t>(done));
+    }
+
+    return true;
+  }
+
+  int                 listener_{-1};
+  in_port_t           port_;
+  std::vector<int>    peers_{};  // rank 0: connections to ranks 1, 2, ...; others: connection to rank 0
+  std::vector<double> buffer_{};
+};
@@ -0,0 +1,225 @@
+#pragma once
+
+#include "fitting.hpp"
+#include "dual.hpp"
+
+#include <vector>
+#include <array>
+#include <cmath>
+#include <limits>
+#include <random>
+#include <algorithm>
+
+
+// Gaussian mixture fitting by stochastic local search (as done by each chain in fit2.cpp)
+//
+// Starting from a given set of peaks (in fit2, those fitted on the previous iteration), each step either alters a random
+// peak, erasing it if it no longer improves the fit or else line searching its position, magnitude or width, or adds
+// a peak at the largest residual with a randomly searched width. The residuals are kept up to date over the support of
+// the one peak each step changes, so a step costs a few passes over that support rather than over the histogram.
+//
+// A line search probes one and two steps along from the peak, growing or shrinking the step by which of the three fits
+// best. Its first step is pointed downhill by the gradient of the fit (found with the fit itself by peak_fit_gradient),
+// so the search does not start by probing the wrong way.
+//
+// Searching the width of added peaks takes a tenth to a quarter of a chain's time (on fit_benchmark.cpp's spectra). That
+// search is split into independent random walks run by loop(count, func) (as serial_loop), so that a caller can share
+// them with threads that have run out of work; the rest is left to run serially, each step depending on the last.
+
+
+template<std::size_t N, class Loop = serial_loop>
+fit_result fit_chain_search(const std::array<double, N>& distribution, const grid_t& grid, std::vector<peak_t> peaks, std::mt19937_64 prng, const Loop& loop = {}, const std::size_t steps = 750)
+{
+  const double span = grid.step * static_cast<double>(N - 1);
+
+  auto chance = [&](const double probability){ return std::bernoulli_distribution(probability)(prng); };
+
+  auto uniform = [&](const double low, const double high){ return std::uniform_real_distribution(low, high)(prng); };
+
+  std::size_t evaluations{0};
+
+  // difference between distribution and all peaks; each step below only changes one peak, so this is updated over that peak's support
+  residuals_t<N> residuals{distribution, grid, peaks};
+
+  // fit of residuals to a peak (by default, of residuals to nothing)
+  auto calculate_fit = [&](const peak_t peak = {0,0,0})
+  {
+    ++evaluations;
+
+    return peak_fit(residuals.values, residuals.sum_of_squares, grid, peak);
+  };
+
+  for (auto _l = steps; _l--;)
+  {
+    // rounding errors accumulate in the incremental updates, so periodically start afresh
+    if (_l % 64 == 0)
+      residuals.recompute(distribution, grid, peaks);
+
+    //if (std::ssize(peaks) > 0 && (std::ssize(peaks) > 10 || std::bernoulli_distribution(0.9)(prng_)))
+    //if (peaks.size() > 1 && std::bernoulli_distribution(1.0 - std::pow(0.4, peaks.size()))(prng_))
+    if (peaks.size() > 1 && chance(1.0 - std::pow(0.666, static_cast<double>(peaks.size()))))
+    {
+      // which peak to alter
+      const std::size_t change_index = std::uniform_int_distribution<std::size_t>(0, peaks.size() - 1)(prng);
+
+      peak_t cpeak = peaks[change_index];
+
+      // residuals now exclude the peak under alteration (until it is included again once altered, if not erased)
+      residuals.exclude(grid, cpeak);
+
+      double prev_fit = calculate_fit(cpeak);
+      double new_fit  = calculate_fit();
+
+      auto optimize_variable = [&]<std::uint32_t var>(double factor)
+      {
+        for (auto _ = 20; _--;)
+        {
+          double fit0;
+          double fit1;
+          double fit2;
+
+          double& variable = var == 0 ? cpeak.position : var == 1 ? cpeak.magnitude : cpeak.width;
+
+          if (_ == 19)
+          {
+            ++evaluations;
+
+            const dual<double, 3> fit = peak_fit_gradient(residuals.values, residuals.sum_of_squares, grid, cpeak);
+
+            fit0 = fit.value;
+
+            // rate of change of the fit along the first step (per unit factor, or per unit log factor)
+            const double slope = var == 0 ? fit.gradient[var] * factor : fit.gradient[var] * variable * std::log(factor);
+
+            if (slope > 0)
+              factor = var == 0 ? -factor : 1.0 / factor;
+          }
+          else
+            fit0 = calculate_fit(cpeak);
+
+          if constexpr (var == 0)
+          {
+            fit1 = calculate_fit({cpeak.position + factor, cpeak.magnitude, cpeak.width});
+            fit2 = calculate_fit({cpeak.position + factor + factor, cpeak.magnitude, cpeak.width});
+          }
+          else if constexpr (var == 1)
+          {
+            fit1 = calculate_fit({cpeak.position, cpeak.magnitude * factor, cpeak.width});
+            fit2 = calculate_fit({cpeak.position, cpeak.magnitude * factor * factor, cpeak.width});
+          }
+          else if constexpr (var == 2)
+          {
+            fit1 = calculate_fit({cpeak.position, cpeak.magnitude, cpeak.width * factor});
+            fit2 = calculate_fit({cpeak.position, cpeak.magnitude, cpeak.width * factor * factor});
+          }
+          //fmt::print("fits:  {}   {}   {}\n", fit0, fit1, fit2);
+          //fmt::print("{}  :  {}   {}   {}    ({})\n", var, variable, variable * factor, variable * factor * factor, factor);
+
+          if (fit1 < fit0 && fit1 < fit2)
+          {
+            if (fit2 < fit0)
+            {
+              if constexpr (var == 0)
+                variable += factor;
+              else
+                variable *= factor;
+            }
+
+            if constexpr (var == 0)
+              factor *= 0.5;
+            else
+              factor = std::sqrt(factor);
+          }
+          else
+          {
+            if (fit1 > fit2 && fit1 > fit0)
+              break;
+
+            if (fit0 < fit2)
+            {
+              if constexpr (var == 0)
+                variable -= factor;
+              else
+              {
+                variable /= factor;
+
+                if constexpr (var == 2)
+                  if (variable <= 0.5)
+                  {
+                    peaks.erase(peaks.begin() + static_cast<std::int64_t>(change_index));
+                    return;
+                  }
+              }
+            }
+
+            if constexpr (var == 0)
+              factor *= 1.5;
+            else
+              factor = std::pow(factor, 1.5);
+          }
+        }
+
+        //peaks[change_index].position = cpeak.position;
+        peaks[change_index] = cpeak;
+
+        residuals.include(grid, cpeak);
+
+        return;
+      };
+
+      if (new_fit <= prev_fit)
+      {
+        peaks.erase(peaks.begin() + static_cast<std::int64_t>(change_index));
+      }
+      else if (chance(0.25))
+      {
+        optimize_variable.template operator()<0>(uniform(-span/500, span/500));
+      }
+      else if (chance(0.5))
+      {
+        optimize_variable.template operator()<1>(uniform(0.5, 1.5));
+      }
+      else
+      {
+        optimize_variable.template operator()<2>(uniform(0.5, 1.5));
+      }
+    }
+    else
+    {
+      /*
+      peaks.emplace_back(uniform(min, max), 
+                             uniform(0.0, static_cast<double>(event_count) * pow<2>(spread) / bucket_count),
+                             uniform(2.5, span));
+                             */
+
+      const auto max_idx = static_cast<std::uint32_t>(std::ranges::max_element(residuals.values) - residuals.values.begin());
+
+      const double position = grid[max_idx];
+
+      const double magnitude = residuals.values[max_idx];
+
+      std::array<std::uint64_t, width_walks> seeds;
+
+      for (auto& seed : seeds)
+        seed = prng();
+
+      const auto [best_width, best_fit] = search_width(residuals.values, residuals.sum_of_squares, grid, position, magnitude, seeds, loop);
+
+      evaluations += width_walks * width_walk_steps;
+
+      if (best_fit == std::numeric_limits<double>::infinity())
+        //fmt::print(fmt::emphasis::bold | fg(fmt::color::red), "ERROR: no change in best_fit when attempting to add a new curve\n");
+      {}
+      else
+      {
+        peaks.emplace_back(position, magnitude, best_width);
+
+        residuals.include(grid, peaks.back());
+      }
+    }
+  }
+
+  residuals.recompute(distribution, grid, peaks);
+
+  return {std::move(peaks), residuals.sum_of_squares, evaluations};
+}
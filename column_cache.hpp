@@ -0,0 +1,181 @@
+#pragma once
+
+#include "root.hpp"
+
+#include <fmt/format.h>
+#include <fmt/color.h>
+
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <vector>
+#include <span>
+#include <string>
+#include <string_view>
+#include <memory>
+#include <mutex>
+#include <fstream>
+#include <filesystem>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+
+
+// The columns of a root file, decompressed to float32 files which are memory mapped
+//
+// A column is decompressed the first time it is asked for, narrowed to float if stored as double (halving its
+// footprint), and written to directory/<name>.f32; after that it is only ever read through its mapping, which is shared
+// by every thread and kept until the cache is destroyed. Column files newer than the root file are reused by later
+// sessions.
+//
+// Asking for a column is thread safe: if several threads ask for the same column first, it is only decompressed once.
+//
+// fit2 reads its variables through one when generate_recombinations has written cache/mass.root.
+class column_cache
+{
+public:
+
+  explicit column_cache(const std::string_view root_path, std::string directory = "cache/columns")
+    : root_path_{root_path}, file_{std::string{root_path}}, directory_{std::move(directory)}, names_{file_.get_names()}
+  {
+    if (names_.empty())
+      fail(fmt::format("no columns in {}", root_path_));
+
+    entries_ = file_.get_entries(names_.front().first);
+
+    if (entries_ == 0)
+      fail(fmt::format("no data present for variable {}", names_.front().first));
+
+    columns_ = std::make_unique<column[]>(names_.size());
+
+    std::filesystem::create_directories(directory_);
+  }
+
+  column_cache(const column_cache&) = delete;
+  column_cache& operator=(const column_cache&) = delete;
+
+  ~column_cache() noexcept
+  {
+    for (std::size_t i = 0; i < names_.size(); ++i)
+      if (!columns_[i].values.empty())
+        ::munmap(const_cast<float*>(columns_[i].values.data()), columns_[i].values.size_bytes());
+  }
+
+  // names of the columns (with their sizes in bytes in the root file)
+  const std::vector<std::pair<std::string_view, std::uint64_t>>& names() const noexcept
+  {
+    return names_;
+  }
+
+  // entries in each column
+  std::size_t entries() const noexcept
+  {
+    return entries_;
+  }
+
+  // the values of column index, decompressing it on first use
+  std::span<const float> operator[](const std::size_t index)
+  {
+    column& c = columns_[index];
+
+    std::call_once(c.ready, [&]{ c.values = map(index); });
+
+    return c.values;
+  }
+
+private:
+
+  struct column
+  {
+    std::once_flag         ready;
+    std::span<const float> values;
+  };
+
+  [[noreturn]] static void fail(const std::string_view reason)
+  {
+    fmt::print(fmt::emphasis::bold | fg(fmt::color::red), "ERROR: column cache: {}\n", reason);
+
+    std::exit(1);
+  }
+
+  std::string path(const std::size_t index) const
+  {
+    std::string name{names_[index].first};
+
+    std::ranges::replace(name, '/', '_');
+
+    return fmt::format("{}/{}.f32", directory_, name);
+  }
+
+  // whether the file for column index holds the right number of values and was written after the root file
+  bool up_to_date(const std::string& column_path) const
+  {
+    std::error_code error{};
+
+    const auto size = std::filesystem::file_size(column_path, error);
+
+    if (error || size != entries_ * sizeof(float))
+      return false;
+
+    const auto written = std::filesystem::last_write_time(column_path, error);
+
+    return !error && written >= std::filesystem::last_write_time(root_path_);
+  }
+
+  // decompress column index from the root file and write it out as floats (to a temporary file, renamed into place)
+  void build(const std::size_t index, const std::string& column_path) const
+  {
+    fmt::print("decompressing variable: {}\n", names_[index].first);
+
+    // narrowed to float if stored as doubles
+    const std::vector<float> narrowed = file_.uncompress_floating<float>(names_[index].first);
+
+    if (narrowed.size() != entries_)
+      fail(fmt::format("inconsistent number of entries in each record: {} in {}; {} in {}", entries_, names_.front().first, narrowed.size(), names_[index].first));
+
+    const std::string temporary_path{fmt::format("{}.tmp", column_path)};
+
+    {
+      std::ofstream out{temporary_path, std::ios::binary};
+
+      out.write(reinterpret_cast<const char*>(narrowed.data()), static_cast<std::streamsize>(narrowed.size() * sizeof(float)));
+
+      if (!out)
+        fail(fmt::format("failed to write {}", temporary_path));
+    }
+
+    if (std::rename(temporary_path.c_str(), column_path.c_str()))
+      fail(fmt::format("failed to rename {} to {}", temporary_path, column_path));
+  }
+
+  // map the file for column index, building it first if needed
+  std::span<const float> map(const std::size_t index) const
+  {
+    const std::string column_path{path(index)};
+
+    if (!up_to_date(column_path))
+      build(index, column_path);
+
+    const int fd = ::open(column_path.c_str(), O_RDONLY);
+
+    if (fd == -1)
+      fail(fmt::format("cannot open {}", column_path));
+
+    void* const data = ::mmap(nullptr, entries_ * sizeof(float), PROT_READ, MAP_SHARED, fd, 0);
+
+    ::close(fd);
+
+    if (data == MAP_FAILED)
+      fail(fmt::format("cannot map {}", column_path));
+
+    return {static_cast<const float*>(data), entries_};
+  }
+
+  std::string                                             root_path_;
+  movency::root::file                                     file_;
+  std::string                                             directory_;
+  std::vector<std::pair<std::string_view, std::uint64_t>> names_;
+  std::size_t                                             entries_{0};
+  std::unique_ptr<column[]>                               columns_;
+};
@@ -0,0 +1,221 @@
+#pragma once
+
+#include "fitting.hpp"
+
+#include <array>
+#include <cmath>
+#include <type_traits>
+
+
+// Forward mode automatic differentiation by dual numbers
+//
+// A dual<T, N> holds a value along with its partial derivatives with respect to N variables, where T is either double
+// or simd::doubles (lanewise). Arithmetic, pow<P>, exp, fast_exp and sqrt carry the derivatives through by the chain
+// rule, so code written over a template type gives its gradient in the same pass as its value. Plain T (or double)
+// operands are treated as constants.
+
+
+template<class T, std::size_t N>
+struct dual
+{
+  T                value{};
+  std::array<T, N> gradient{};
+
+  constexpr dual() noexcept = default;
+
+  // a constant (implicit, so that constants such as those returned by pow<0> convert)
+  constexpr dual(const T val) noexcept : value{val} {}
+
+  constexpr dual(const double val) noexcept requires (!std::is_same_v<T, double>) : value{T{} + val} {}
+
+  // variable index of the N, at val
+  static constexpr dual variable(const T val, const std::size_t index) noexcept
+  {
+    dual out{val};
+
+    out.gradient[index] = T{} + 1.0;
+
+    return out;
+  }
+
+  // f(value), given f'(value)
+  constexpr dual chain(const T val, const T derivative) const noexcept
+  {
+    dual out{val};
+
+    for (std::size_t i = 0; i < N; ++i)
+      out.gradient[i] = derivative * gradient[i];
+
+    return out;
+  }
+
+  constexpr dual operator-() const noexcept
+  {
+    return chain(-value, T{} - 1.0);
+  }
+
+  constexpr dual& operator+=(const dual& rhs) noexcept
+  {
+    value += rhs.value;
+
+    for (std::size_t i = 0; i < N; ++i)
+      gradient[i] += rhs.gradient[i];
+
+    return *this;
+  }
+
+  constexpr dual& operator-=(const dual& rhs) noexcept
+  {
+    value -= rhs.value;
+
+    for (std::size_t i = 0; i < N; ++i)
+      gradient[i] -= rhs.gradient[i];
+
+    return *this;
+  }
+
+  constexpr dual& operator*=(const dual& rhs) noexcept
+  {
+    for (std::size_t i = 0; i < N; ++i)
+      gradient[i] = gradient[i] * rhs.value + value * rhs.gradient[i];
+
+    value *= rhs.value;
+
+    return *this;
+  }
+
+  constexpr dual& operator/=(const dual& rhs) noexcept
+  {
+    const T inverse = 1.0 / rhs.value;
+
+    value *= inverse;
+
+    for (std::size_t i = 0; i < N; ++i)
+      gradient[i] = (gradient[i] - value * rhs.gradient[i]) * inverse;
+
+    return *this;
+  }
+
+  // constants skip the work on their (zero) gradient
+  constexpr dual& operator+=(const T rhs) noexcept { value += rhs; return *this; }
+  constexpr dual& operator-=(const T rhs) noexcept { value -= rhs; return *this; }
+
+  constexpr dual& operator*=(const T rhs) noexcept
+  {
+    value *= rhs;
+
+    for (std::size_t i = 0; i < N; ++i)
+      gradient[i] *= rhs;
+
+    return *this;
+  }
+
+  constexpr dual& operator/=(const T rhs) noexcept
+  {
+    return *this *= T{} + 1.0 / rhs;
+  }
+};
+
+
+template<class T, std::size_t N> constexpr dual<T, N> operator+(dual<T, N> lhs, const dual<T, N>& rhs) noexcept { return lhs += rhs; }
+template<class T, std::size_t N> constexpr dual<T, N> operator-(dual<T, N> lhs, const dual<T, N>& rhs) noexcept { return lhs -= rhs; }
+template<class T, std::size_t N> constexpr dual<T, N> operator*(dual<T, N> lhs, const dual<T, N>& rhs) noexcept { return lhs *= rhs; }
+template<class T, std::size_t N> constexpr dual<T, N> operator/(dual<T, N> lhs, const dual<T, N>& rhs) noexcept { return lhs /= rhs; }
+
+template<class T, std::size_t N> constexpr dual<T, N> operator+(dual<T, N> lhs, const std::type_identity_t<T> rhs) noexcept { return lhs += rhs; }
+template<class T, std::size_t N> constexpr dual<T, N> operator-(dual<T, N> lhs, const std::type_identity_t<T> rhs) noexcept { return lhs -= rhs; }
+template<class T, std::size_t N> constexpr dual<T, N> operator*(dual<T, N> lhs, const std::type_identity_t<T> rhs) noexcept { return lhs *= rhs; }
+template<class T, std::size_t N> constexpr dual<T, N> operator/(dual<T, N> lhs, const std::type_identity_t<T> rhs) noexcept { return lhs /= rhs; }
+
+template<class T, std::size_t N> constexpr dual<T, N> operator+(const std::type_identity_t<T> lhs, dual<T, N> rhs) noexcept { return rhs += lhs; }
+template<class T, std::size_t N> constexpr dual<T, N> operator-(const std::type_identity_t<T> lhs, const dual<T, N>& rhs) noexcept { return -rhs + lhs; }
+template<class T, std::size_t N> constexpr dual<T, N> operator*(const std::type_identity_t<T> lhs, dual<T, N> rhs) noexcept { return rhs *= lhs; }
+template<class T, std::size_t N> constexpr dual<T, N> operator/(const std::type_identity_t<T> lhs, const dual<T, N>& rhs) noexcept { return dual<T, N>{lhs} / rhs; }
+
+// double constants with simd duals (broadcast)
+template<std::size_t N> constexpr dual<simd::doubles, N> operator+(const dual<simd::doubles, N>& lhs, const double rhs) noexcept { return lhs + (simd::doubles{} + rhs); }
+template<std::size_t N> constexpr dual<simd::doubles, N> operator-(const dual<simd::doubles, N>& lhs, const double rhs) noexcept { return lhs - (simd::doubles{} + rhs); }
+template<std::size_t N> constexpr dual<simd::doubles, N> operator*(const dual<simd::doubles, N>& lhs, const double rhs) noexcept { return lhs * (simd::doubles{} + rhs); }
+template<std::size_t N> constexpr dual<simd::doubles, N> operator/(const dual<simd::doubles, N>& lhs, const double rhs) noexcept { return lhs / (simd::doubles{} + rhs); }
+template<std::size_t N> constexpr dual<simd::doubles, N> operator+(const double lhs, const dual<simd::doubles, N>& rhs) noexcept { return (simd::doubles{} + lhs) + rhs; }
+template<std::size_t N> constexpr dual<simd::doubles, N> operator-(const double lhs, const dual<simd::doubles, N>& rhs) noexcept { return (simd::doubles{} + lhs) - rhs; }
+template<std::size_t N> constexpr dual<simd::doubles, N> operator*(const double lhs, const dual<simd::doubles, N>& rhs) noexcept { return (simd::doubles{} + lhs) * rhs; }
+template<std::size_t N> constexpr dual<simd::doubles, N> operator/(const double lhs, const dual<simd::doubles, N>& rhs) noexcept { return (simd::doubles{} + lhs) / rhs; }
+
+
+template<class T, std::size_t N>
+[[nodiscard]] inline dual<T, N> fast_exp(const dual<T, N>& x) noexcept
+{
+  const T val = fast_exp(x.value);
+
+  return x.chain(val, val);
+}
+
+template<class T, std::size_t N>
+[[nodiscard]] inline dual<T, N> exp(const dual<T, N>& x) noexcept
+{
+  if constexpr (std::is_same_v<T, double>)
+  {
+    const double val = std::exp(x.value);
+
+    return x.chain(val, val);
+  }
+  else
+    return fast_exp(x);
+}
+
+template<std::size_t N>
+[[nodiscard]] inline dual<double, N> sqrt(const dual<double, N>& x) noexcept
+{
+  const double val = std::sqrt(x.value);
+
+  return x.chain(val, 0.5 / val);
+}
+
+
+// peak_fit (the sum over buckets of (value of peak - residuals)^2) along with its gradient with respect to the peak's
+// position, magnitude and width (in that order), in one pass over the support of the peak
+inline dual<double, 3> peak_fit_gradient(const std::span<const double> residuals, const double residuals_sum_of_squares, const grid_t& grid, const peak_t& peak) noexcept
+{
+  using vector_dual = dual<simd::doubles, 3>;
+
+  const vector_dual position    = vector_dual::variable(simd::doubles{} + peak.position,  0);
+  const vector_dual magnitude   = vector_dual::variable(simd::doubles{} + peak.magnitude, 1);
+  const vector_dual inverse_width = 1.0 / vector_dual::variable(simd::doubles{} + peak.width, 2);
+
+  const auto [from, to] = grid.support(peak);
+
+  vector_dual fits{};
+
+  std::size_t i = from;
+
+  for (; i + simd::width <= to; i += simd::width)
+  {
+    const simd::doubles x = grid.min + (static_cast<double>(i) + simd::lane_indexes) * grid.step;
+
+    const vector_dual val = magnitude * fast_exp(-pow<2>((x - position) * inverse_width));
+
+    fits += val * (val - 2.0 * simd::load(&residuals[i]));
+  }
+
+  dual<double, 3> out{residuals_sum_of_squares};
+
+  out.value += simd::sum(fits.value);
+
+  for (std::size_t k = 0; k < 3; ++k)
+    out.gradient[k] = simd::sum(fits.gradient[k]);
+
+  // remaining buckets one at a time
+  const dual<double, 3> scalar_position      = dual<double, 3>::variable(peak.position,  0);
+  const dual<double, 3> scalar_magnitude     = dual<double, 3>::variable(peak.magnitude, 1);
+  const dual<double, 3> scalar_inverse_width = 1.0 / dual<double, 3>::variable(peak.width, 2);
+
+  for (; i < to; ++i)
+  {
+    const dual<double, 3> val = scalar_magnitude * fast_exp(-pow<2>((grid[i] - scalar_position) * scalar_inverse_width));
+
+    out += val * (val - 2.0 * residuals[i]);
+  }
+
+  return out;
+}
@@ -0,0 +1,141 @@
+#include "dual.hpp"
+
+#include <fmt/format.h>
+#include <fmt/color.h>
+
+#include <array>
+#include <span>
+#include <cmath>
+#include <random>
+#include <string_view>
+#include <cstdlib>
+
+
+// Checks the values and gradients given by dual numbers (scalar and simd) and by peak_fit_gradient against plain
+// evaluation and central finite differences
+
+
+// exits unless found is within tolerance of expected (relative to expected, or absolute when expected is below 1), or
+// within noise of it as well
+void check(const double found, const double expected, const double tolerance, const std::string_view what, const double noise = 0)
+{
+  if (std::abs(found - expected) <= tolerance * std::max(1.0, std::abs(expected)) + noise)
+    return;
+
+  fmt::print(fmt::emphasis::bold | fg(fmt::color::red), "ERROR: {} is {} rather than {}\n", what, found, expected);
+  std::exit(1);
+}
+
+
+// a function of two variables exercising every operation dual numbers support
+template<class T>
+T composite(const T a, const T b)
+{
+  return sqrt(a * b + exp(a) / b) - 3.0 * a + fast_exp(-pow<2>(b)) * (a - b) / (1.0 + a * a) + pow<3>(b) - (2.0 - a) / b;
+}
+
+double plain_composite(const double a, const double b)
+{
+  return std::sqrt(a * b + std::exp(a) / b) - 3.0 * a + std::exp(-b * b) * (a - b) / (1.0 + a * a) + b * b * b - (2.0 - a) / b;
+}
+
+// simd version (without sqrt, which has no simd dual overload)
+template<class T>
+T simd_composite(const T a, const T b)
+{
+  return a * b + exp(a) / b - 3.0 * a + fast_exp(-pow<2>(b)) * (a - b) / (1.0 + a * a) + pow<3>(b) - (2.0 - a) / b;
+}
+
+double plain_simd_composite(const double a, const double b)
+{
+  return a * b + std::exp(a) / b - 3.0 * a + std::exp(-b * b) * (a - b) / (1.0 + a * a) + b * b * b - (2.0 - a) / b;
+}
+
+
+int main()
+{
+  std::mt19937_64 prng{1};
+
+  auto uniform = [&](const double low, const double high){ return std::uniform_real_distribution(low, high)(prng); };
+
+  constexpr double h{1e-6}; // finite difference step
+
+  for (int trial = 0; trial < 100; ++trial)
+  {
+    const double a = uniform(0.1, 2.0);
+    const double b = uniform(0.5, 1.5);
+
+    const auto f = composite(dual<double, 2>::variable(a, 0), dual<double, 2>::variable(b, 1));
+
+    check(f.value,       plain_composite(a, b),                                                  1e-12, fmt::format("composite({}, {})", a, b));
+    check(f.gradient[0], (plain_composite(a + h, b) - plain_composite(a - h, b)) / (2.0 * h), 1e-6,  fmt::format("d composite / da at ({}, {})", a, b));
+    check(f.gradient[1], (plain_composite(a, b + h) - plain_composite(a, b - h)) / (2.0 * h), 1e-6,  fmt::format("d composite / db at ({}, {})", a, b));
+
+    // each lane its own point
+    simd::doubles as;
+    simd::doubles bs;
+
+    for (std::size_t l = 0; l < simd::width; ++l)
+    {
+      as[l] = uniform(0.1, 2.0);
+      bs[l] = uniform(0.5, 1.5);
+    }
+
+    const auto g = simd_composite(dual<simd::doubles, 2>::variable(as, 0), dual<simd::doubles, 2>::variable(bs, 1));
+
+    for (std::size_t l = 0; l < simd::width; ++l)
+    {
+      const double al = as[l];
+      const double bl = bs[l];
+
+      check(g.value[l],       plain_simd_composite(al, bl),                                                        1e-12, fmt::format("simd composite({}, {})", al, bl));
+      check(g.gradient[0][l], (plain_simd_composite(al + h, bl) - plain_simd_composite(al - h, bl)) / (2.0 * h), 1e-6,  fmt::format("d simd composite / da at ({}, {})", al, bl));
+      check(g.gradient[1][l], (plain_simd_composite(al, bl + h) - plain_simd_composite(al, bl - h)) / (2.0 * h), 1e-6,  fmt::format("d simd composite / db at ({}, {})", al, bl));
+    }
+  }
+
+  // peak_fit_gradient against peak_fit, for peaks anywhere on (and partly off) the grid
+  constexpr std::size_t bucket_count{1000};
+
+  const grid_t grid = grid_t::spanning(0.0, 100.0, bucket_count);
+
+  std::array<double, bucket_count> residuals;
+
+  for (double& r : residuals)
+    r = uniform(-1.0, 10.0);
+
+  const double residuals_sum_of_squares = sum_of_squares(residuals);
+
+  for (int trial = 0; trial < 1000; ++trial)
+  {
+    const peak_t peak{uniform(-5.0, 105.0), uniform(0.1, 20.0), uniform(0.05, 10.0)};
+
+    const dual<double, 3> fit = peak_fit_gradient(residuals, residuals_sum_of_squares, grid, peak);
+
+    check(fit.value, peak_fit(residuals, residuals_sum_of_squares, grid, peak), 1e-12, fmt::format("peak_fit_gradient value at {}", peak));
+
+    // relative step in each parameter (the fit is smooth as long as no bucket enters or leaves the peak's support)
+    for (std::size_t k = 0; k < 3; ++k)
+    {
+      const double step = 1e-6 * (k == 0 ? peak.width : k == 1 ? peak.magnitude : peak.width);
+
+      peak_t above{peak};
+      peak_t below{peak};
+
+      (k == 0 ? above.position : k == 1 ? above.magnitude : above.width) += step;
+      (k == 0 ? below.position : k == 1 ? below.magnitude : below.width) -= step;
+
+      if (grid.support(above) != grid.support(below))
+        continue;
+
+      const double difference = (peak_fit(residuals, residuals_sum_of_squares, grid, above) - peak_fit(residuals, residuals_sum_of_squares, grid, below)) / (2.0 * step);
+
+      // each fit includes the sum of squares of every residual, so the difference carries rounding noise of that scale
+      check(fit.gradient[k], difference, 1e-6, fmt::format("peak_fit_gradient[{}] at {}", k, peak), 1e-12 * residuals_sum_of_squares / step);
+    }
+  }
+
+  fmt::print(fg(fmt::color::green), "dual numbers and peak_fit_gradient agree with finite differences\n");
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,349 @@
+#pragma once
+
+#include "fitting.hpp"
+#include "threading.hpp"
+
+#include <vector>
+#include <span>
+#include <cmath>
+#include <numbers>
+#include <algorithm>
+
+
+// Unbinned fitting of a gaussian mixture plus smooth background to weighted event values, by expectation-maximisation
+//
+// The background is a bernstein polynomial density of degree background_degree over [min, max]: a mixture of beta
+// densities, so its coefficients are fitted by em alongside the gaussians. The e-step runs over events in simd vectors
+// and in parallel over chunks of events using the thread pool (so fit_em must not be called from several threads at once).
+//
+// Components keep the order of the seeds they are started from, so a seed peak's responsibility for an event can be
+// looked up by its index.
+
+
+struct em_options
+{
+  std::size_t background_degree{6};
+  std::size_t max_iterations{100};
+  double      tolerance{1e-7};      // relative change in log likelihood at which to stop
+};
+
+
+struct em_component
+{
+  double mean;
+  double sigma;
+  double fraction; // of the total event weight
+};
+
+
+struct em_result
+{
+  std::vector<em_component> peaks;
+  std::vector<double>       background; // fraction of the total event weight in each bernstein basis density
+
+  double      min;
+  double      max;
+  double      total_weight;
+  double      log_likelihood;
+  std::size_t iterations;
+
+  // weighted event density at x due to peak j
+  double peak_density(const std::size_t j, const double x) const noexcept
+  {
+    const em_component& c = peaks[j];
+
+    return c.fraction / (c.sigma * std::sqrt(2.0 * std::numbers::pi)) * fast_exp(-0.5 * pow<2>((x - c.mean) / c.sigma));
+  }
+
+  double background_density(const double x) const noexcept
+  {
+    const std::size_t degree = background.size() - 1;
+
+    const double t = std::clamp((x - min) / (max - min), 0.0, 1.0);
+
+    double out{0};
+
+    double binomial{1};
+
+    for (std::size_t k = 0; k <= degree; ++k)
+    {
+      out += background[k] * binomial * std::pow(t, static_cast<double>(k)) * std::pow(1.0 - t, static_cast<double>(degree - k));
+
+      binomial = binomial * static_cast<double>(degree - k) / static_cast<double>(k + 1);
+    }
+
+    return out * static_cast<double>(degree + 1) / (max - min);
+  }
+
+  double density(const double x) const noexcept
+  {
+    double out = background_density(x);
+
+    for (std::size_t j = 0; j < peaks.size(); ++j)
+      out += peak_density(j, x);
+
+    return out;
+  }
+
+  // posterior probability that an event at x belongs to peak j
+  double responsibility(const std::size_t j, const double x) const noexcept
+  {
+    const double total = density(x);
+
+    return total > 0 ? peak_density(j, x) / total : 0.0;
+  }
+
+  // posterior probability that each of a simd vector of events belongs to peak j
+  simd::doubles responsibility(const std::size_t j, const simd::doubles x) const noexcept
+  {
+    simd::doubles total{};
+    simd::doubles peak{};
+
+    for (std::size_t k = 0; k < peaks.size(); ++k)
+    {
+      const em_component& c = peaks[k];
+
+      const simd::doubles offset = (x - c.mean) * (1.0 / c.sigma);
+
+      const simd::doubles d = c.fraction / (c.sigma * std::sqrt(2.0 * std::numbers::pi)) * fast_exp(-0.5 * offset * offset);
+
+      total += d;
+
+      if (k == j)
+        peak = d;
+    }
+
+    // background by horner's scheme in t and 1 - t: ((b0 s + b1 t) s + b2 t^2) s ... + bn t^n
+    const std::size_t degree = background.size() - 1;
+
+    simd::doubles t = (x - min) * (1.0 / (max - min));
+
+    t = t < 0.0 ? simd::doubles{} : t > 1.0 ? simd::doubles{} + 1.0 : t;
+
+    const simd::doubles s = 1.0 - t;
+
+    simd::doubles t_power = simd::doubles{} + 1.0;
+    simd::doubles bernstein{};
+
+    double binomial{1};
+
+    for (std::size_t k = 0; k <= degree; ++k)
+    {
+      bernstein = bernstein * s + background[k] * binomial * t_power;
+
+      t_power *= t;
+
+      binomial = binomial * static_cast<double>(degree - k) / static_cast<double>(k + 1);
+    }
+
+    total += bernstein * (static_cast<double>(degree + 1) / (max - min));
+
+    return total > 0.0 ? peak / total : simd::doubles{};
+  }
+
+  // peak j as it would appear in a histogram of the same events with the given bucket spacing and total
+  peak_t to_peak(const std::size_t j, const double step, const double histogram_total) const noexcept
+  {
+    const em_component& c = peaks[j];
+
+    return {c.mean, c.fraction * histogram_total * step / (c.sigma * std::sqrt(2.0 * std::numbers::pi)), c.sigma * std::numbers::sqrt2};
+  }
+};
+
+
+// em components matching peaks fitted to a histogram with the given bucket spacing and total
+inline std::vector<em_component> seed_components(const std::span<const peak_t> peaks, const double step, const double histogram_total)
+{
+  std::vector<em_component> out{};
+
+  out.reserve(peaks.size());
+
+  for (const peak_t& peak : peaks)
+    out.emplace_back(peak.position, peak.width / std::numbers::sqrt2, std::max(0.0, peak.magnitude * peak.width * std::sqrt(std::numbers::pi) / step / histogram_total));
+
+  // leave at least 10% of the weight to the background
+  double total{0};
+
+  for (const em_component& c : out)
+    total += c.fraction;
+
+  if (total > 0.9)
+    for (em_component& c : out)
+      c.fraction *= 0.9 / total;
+
+  return out;
+}
+
+
+template<class T>
+em_result fit_em(const std::span<const T> values, const std::span<const double> weights, std::vector<em_component> seeds, const em_options& options = {})
+{
+  const auto [min_it, max_it] = std::ranges::minmax_element(values);
+
+  em_result out{std::move(seeds), {}, *min_it, *max_it, 0, -std::numeric_limits<double>::infinity(), 0};
+
+  if (out.max <= out.min)
+    out.max = out.min + 1;
+
+  for (const double w : weights)
+    out.total_weight += w;
+
+  const std::size_t peak_count       = out.peaks.size();
+  const std::size_t degree           = options.background_degree;
+  const std::size_t background_count = degree + 1;
+
+  {
+    double peak_fraction{0};
+
+    for (const em_component& c : out.peaks)
+      peak_fraction += c.fraction;
+
+    out.background.assign(background_count, std::max(0.1, 1.0 - peak_fraction) / static_cast<double>(background_count));
+  }
+
+  const double min_sigma = (out.max - out.min) * 1e-5;
+
+  // per chunk of events: for each peak sum w r, sum w r x, sum w r x^2; for each background density sum w r; then sum w log(density)
+  const std::size_t accumulator_count = 3 * peak_count + background_count + 1;
+
+  constexpr std::size_t chunk_size{1 << 14};
+
+  const std::size_t chunk_count = (values.size() + chunk_size - 1) / chunk_size;
+
+  std::vector<std::vector<double>> accumulators(chunk_count, std::vector<double>(accumulator_count));
+
+  std::vector<double> binomials(background_count);
+
+  for (std::size_t k = 0, b = 1; k <= degree; b = b * (degree - k) / (k + 1), ++k)
+    binomials[k] = static_cast<double>(b);
+
+  for (out.iterations = 0; out.iterations < options.max_iterations; ++out.iterations)
+  {
+    // per component constants: density = coefficient * exp(-0.5 * ((x - mean) * scale)^2)
+    std::vector<double> coefficients(peak_count + background_count);
+    std::vector<double> scales(peak_count);
+
+    for (std::size_t j = 0; j < peak_count; ++j)
+    {
+      coefficients[j] = out.peaks[j].fraction / (out.peaks[j].sigma * std::sqrt(2.0 * std::numbers::pi));
+      scales[j]       = 1.0 / out.peaks[j].sigma;
+    }
+
+    for (std::size_t k = 0; k < background_count; ++k)
+      coefficients[peak_count + k] = out.background[k] * binomials[k] * static_cast<double>(background_count) / (out.max - out.min);
+
+    // e-step, accumulating the sums needed by the m-step
+    loop_threaded([&](const std::size_t chunk)
+    {
+      std::vector<simd::doubles> sums(accumulator_count);
+      std::vector<simd::doubles> densities(peak_count + background_count);
+      std::vector<simd::doubles> t_powers(background_count);
+      std::vector<simd::doubles> s_powers(background_count);
+
+      const std::size_t from = chunk * chunk_size;
+      const std::size_t to   = std::min(values.size(), from + chunk_size);
+
+      for (std::size_t i = from; i < to; i += simd::width)
+      {
+        // lanes beyond the last event are given zero weight
+        simd::doubles x{};
+        simd::doubles w{};
+
+        for (std::size_t l = 0; l < simd::width; ++l)
+        {
+          x[l] = static_cast<double>(values [std::min(i + l, to - 1)]);
+          w[l] = i + l < to ? weights[i + l] : 0.0;
+        }
+
+        simd::doubles total{};
+
+        for (std::size_t j = 0; j < peak_count; ++j)
+        {
+          const simd::doubles offset = (x - out.peaks[j].mean) * scales[j];
+
+          densities[j] = coefficients[j] * fast_exp(-0.5 * offset * offset);
+
+          total += densities[j];
+        }
+
+        simd::doubles t = (x - out.min) * (1.0 / (out.max - out.min));
+
+        t = t < 0.0 ? simd::doubles{} : t > 1.0 ? simd::doubles{} + 1.0 : t;
+
+        t_powers[0] = simd::doubles{} + 1.0;
+        s_powers[0] = simd::doubles{} + 1.0;
+
+        for (std::size_t k = 1; k < background_count; ++k)
+        {
+          t_powers[k] = t_powers[k - 1] * t;
+          s_powers[k] = s_powers[k - 1] * (1.0 - t);
+        }
+
+        for (std::size_t k = 0; k < background_count; ++k)
+        {
+          densities[peak_count + k] = coefficients[peak_count + k] * t_powers[k] * s_powers[degree - k];
+
+          total += densities[peak_count + k];
+        }
+
+        // weight divided by total density (so density * scaled gives weight * responsibility)
+        const simd::doubles scaled = total > 0.0 ? w / total : simd::doubles{};
+
+        for (std::size_t j = 0; j < peak_count; ++j)
+        {
+          const simd::doubles wr = densities[j] * scaled;
+
+          sums[3 * j]     += wr;
+          sums[3 * j + 1] += wr * x;
+          sums[3 * j + 2] += wr * x * x;
+        }
+
+        for (std::size_t k = 0; k < background_count; ++k)
+          sums[3 * peak_count + k] += densities[peak_count + k] * scaled;
+
+        for (std::size_t l = 0; l < simd::width; ++l)
+          if (w[l] > 0 && total[l] > 0)
+            sums.back()[l] += w[l] * std::log(total[l]);
+      }
+
+      for (std::size_t a = 0; a < accumulator_count; ++a)
+        accumulators[chunk][a] = simd::sum(sums[a]);
+    }, chunk_count);
+
+    std::vector<double> totals(accumulator_count);
+
+    for (const auto& chunk : accumulators)
+      for (std::size_t a = 0; a < accumulator_count; ++a)
+        totals[a] += chunk[a];
+
+    // m-step
+    for (std::size_t j = 0; j < peak_count; ++j)
+    {
+      em_component& c = out.peaks[j];
+
+      const double weight = totals[3 * j];
+
+      c.fraction = weight / out.total_weight;
+
+      if (weight <= 0)
+        continue;
+
+      c.mean  = totals[3 * j + 1] / weight;
+      c.sigma = std::max(min_sigma, std::sqrt(std::max(0.0, totals[3 * j + 2] / weight - c.mean * c.mean)));
+    }
+
+    for (std::size_t k = 0; k < background_count; ++k)
+      out.background[k] = totals[3 * peak_count + k] / out.total_weight;
+
+    const double log_likelihood = totals.back();
+
+    const bool converged = std::abs(log_likelihood - out.log_likelihood) <= options.tolerance * std::abs(log_likelihood);
+
+    out.log_likelihood = log_likelihood;
+
+    if (converged)
+      break;
+  }
+
+  return out;
+}
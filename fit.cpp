@@ -1,82 +1,66 @@
-#include "TCanvas.h"
-#include "TGraph.h"
-#include "TMultiGraph.h"
-#include "ROOT/RDataFrame.hxx"
-
-#include "timeblit/random.hpp"
+#include "fitting.hpp"
+#include "random_search.hpp"
+#include "levenberg_marquardt.hpp"
+#include "threading.hpp"
+#include "histogram.hpp"
+#include "kde.hpp"
+#include "result_cache.hpp"
+#include "plotting.hpp"
+#include "root.hpp"
 
 #include <fmt/format.h>
 #include <fmt/compile.h>
 #include <fmt/color.h>
 
-#include <memory>
 #include <thread>
 #include <array>
 #include <algorithm>
-#include <random>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <string_view>
+#include <filesystem>
+#include <optional>
 
 using namespace movency;
 
 
-// x to the power of non-negative integer P
-template<std::size_t P>
-[[nodiscard]] constexpr auto pow(auto x) -> decltype(x)
-{
-  if constexpr (P == 0)
-    return 1;
-  else if constexpr (P % 2 == 0)
-    return pow<P/2>(x) * pow<P/2>(x);
-  else
-    return x * pow<P/2>(x) * pow<P/2>(x);
-}
-
+enum class fit_engine {random, lm, both};
 
 
-struct peak_t
+auto fit(const fit_engine engine)
 {
-  double position;
-  double magnitude;
-  double width;
-};
+  // columns are read concurrently (each thread decompressing its own variable), so need no lock
+  const movency::root::file r("cache/mass.root");
 
+  const auto cols = r.get_names();
 
-template <>
-struct fmt::formatter<peak_t>
-{
-  constexpr auto parse(format_parse_context& ctx)
+  if (cols.empty())
   {
-    return ctx.end();
-  }
+    fmt::print(fmt::emphasis::bold | fg(fmt::color::red), "ERROR: no variables present in cache/mass.root\n");
 
-  template<class FormatContext>
-  auto format(const peak_t& p, FormatContext& ctx)
-  {
-    return fmt::format_to(ctx.out(), FMT_COMPILE("p:{} m:{} w:{}"), p.position, p.magnitude, p.width);
+    std::exit(1);
   }
-};
 
+  const auto event_count = r.get_entries(cols.front().first);
 
+  // plots are rendered and written on the plotter's own threads, so fitting never waits on them
+  plotting::plotter plots{2};
 
+  std::atomic<std::uint32_t> next{0};
 
-auto fit()
-{
-  //ROOT::EnableImplicitMT(); // Breaks saving of graphs (causes seperate (inaccessible???) canvases for each(?) thread)
-
-
-  //std::ifstream in;
-  
-
-  ROOT::RDataFrame rdf{"Masses", "cache/mass.root"};
-
-  const auto cols = rdf.GetColumnNames();
+  // lets threads that have run out of variables help with the fits still running (one for each loop thread spawned below)
+  work_sharing sharing{std::max(1u, std::thread::hardware_concurrency()) - 1};
 
-  std::mutex data_mutex;
+  std::ofstream benchmark{"cache/fit_engines.txt"};
 
-  auto canvas = std::make_unique<TCanvas>("canvas", "canvas", 3000, 1900);
+  std::mutex benchmark_mutex;
 
-  std::mutex canvas_mutex;
+  // results of earlier runs, keyed by a hash of everything a variable's fit depends on, so unchanged fits are not redone
+  const result_cache results{};
 
-  std::atomic<std::uint32_t> next{0};
+  constexpr std::uint32_t fitter_version{2}; // bump whenever a change to fitting alters its results, so older results are not reused
 
   //for (int n = 0; n < std::ssize(vecs); ++n)
   auto loop = [&]
@@ -86,206 +70,118 @@ auto fit()
       auto n = next.fetch_add(1, std::memory_order_relaxed);
 
       if (n >= cols.size())
-        return;
-
-      fmt::print("about to read variable: {}\n", cols[n]);
-
-      const std::vector<double> vec = [&]
       {
-        const std::scoped_lock lock(data_mutex);
+        sharing.done();
 
-        fmt::print("reading variable: {}\n", cols[n]);
+        return;
+      }
 
-        std::vector<double> out = *rdf.Take<double>(cols[n]);
+      fmt::print("reading variable: {}\n", cols[n].first);
 
-        std::ranges::sort(out);
+      // masses may be stored as floats or doubles (see generate_recombinations)
+      const std::vector<double> vec = r.uncompress_floating<double>(cols[n].first);
 
-        return out;
-      }();
+      if (vec.empty())
+      {
+        fmt::print(fmt::emphasis::bold | fg(fmt::color::red), "ERROR: No data present for variable {} (index n={})\n", cols[n].first, n);
 
-      fmt::print("fitting variable: {}\n", cols[n]);
+        std::exit(1);
+      }
 
-      const auto min = vec.front();
-      const auto max = vec.back();
+      if (vec.size() != event_count)
+      {
+        fmt::print(fmt::emphasis::bold | fg(fmt::color::red), "ERROR: inconsistent number of entries in each record: {} in {}; {} in {}\n", event_count, cols.front().first, vec.size(), cols[n].first);
 
-      const auto span = max - min;
+        std::exit(1);
+      }
+
+      fmt::print("fitting variable: {}\n", cols[n].first);
 
       constexpr int bucket_count{1000};
 
-      constexpr double spread{2.0}; // how far each point should bleed into neighbouring buckets (linearly)
+      constexpr std::size_t fine_bucket_count{16384}; // bins the values are sorted into before smoothing
 
-      // values represented by buckets
-      const auto dist_vals = [&]
-      {
-        std::array<double, bucket_count> out;
+      constexpr double spread{2.0}; // densities are scaled to match histograms in which each point bled this many buckets either side (linearly)
 
-        for (std::uint32_t i = 0; i < out.size(); ++i)
-          out[i] = min + static_cast<double>(i) / static_cast<double>(bucket_count - 1) * span;
+      // values binned finely (serially, as each thread is already working on its own variable)
+      const auto fine = make_histogram<fine_bucket_count, double>(vec, {}, 1.0);
 
-        return out;
-      }();
+      const grid_t grid = grid_t::spanning(fine.grid.min, fine.grid[fine_bucket_count - 1], bucket_count);
+
+      // independent pieces of this variable's work, shared with threads that have run out of variables
+      auto shared_loop = [&](const std::size_t count, const auto& func){ sharing.share(count, func); };
 
-      // distribution of values
+      // distribution of values: an adaptive kernel density, a bucket wide where values are typical
       const auto distribution = [&]
       {
-        std::array<double, bucket_count> out{};
+        auto out = kernel_density<bucket_count>(fine.values, fine.grid, grid, {.bandwidth = grid.step}, shared_loop);
 
-        for (const double val : vec)
-        {
-          const double distance = (val - min) / span * static_cast<double>(bucket_count);
-
-          const auto from = static_cast<std::uint32_t>(std::max(0,          static_cast<std:: int32_t>(distance - spread)    ));
-          const auto to   = static_cast<std::uint32_t>(std::min(out.size(), static_cast<std::uint64_t>(distance + spread) + 1));
-
-          for (std::uint32_t i = from; i < to; ++i)
-            out[i] += std::max(0.0, spread - std::abs(dist_vals[i] - min) / span);
-        }
+        for (double& d : out)
+          d *= pow<2>(spread);
 
         return out;
       }();
 
-      std::vector<peak_t> peaks{};
+      const double min  = grid.min;
+      const double max  = grid[bucket_count - 1];
+      const double span = max - min;
 
-      auto generate_new_peaks = [&]
+      // values represented by buckets
+      const auto dist_vals = [&]
       {
-        using namespace random;
-
-        auto new_peaks = peaks;
-
-        //if (std::ssize(new_peaks) > 0 && (std::ssize(new_peaks) > 10 || std::bernoulli_distribution(0.9)(prng_)))
-        //if (new_peaks.size() > 1 && std::bernoulli_distribution(1.0 - std::pow(0.4, new_peaks.size()))(prng_))
-        if (new_peaks.size() > 1 && random::fast(uniform_distribution<bool>(1.0 - std::pow(0.4, new_peaks.size()))))
-        {
-          // index of gaussian to alter
-          const std::size_t change_index = random::fast(uniform_distribution(0ul, new_peaks.size() - 1));
-
-          //if (std::bernoulli_distribution(0.25)(prng_))
-          if (random::fast(uniform_distribution<bool>(0.25)))
-          {
-            new_peaks.erase(new_peaks.begin() + static_cast<std::int64_t>(change_index));
-          }
-          //else if (std::bernoulli_distribution(0.1)(prng_))
-          else if (random::fast(uniform_distribution<bool>(0.1)))
-          {
-            new_peaks[change_index].position += random::fast(uniform_distribution(-span/100, span/100));
-          }
-          //else if (std::bernoulli_distribution(0.5)(prng_))
-          else if (random::fast<bool>())
-          {
-            new_peaks[change_index].magnitude *= random::fast(uniform_distribution(0.5, 2.0));
-          }
-          else
-          {
-            new_peaks[change_index].width *= random::fast(uniform_distribution(0.5, 2.0));
-          }
-        }
-        else
-        {
-          /*
-          new_peaks.emplace_back(random::fast(uniform_distribution(min, max)), 
-                                 random::fast(uniform_distribution(0.0, static_cast<double>(vec.size()) * pow<2>(spread) / bucket_count)),
-                                 random::fast(uniform_distribution(2.5, span)));
-                                 */
-
-          const auto residuals = [&]
-          {
-            std::array<double, bucket_count> out;
-
-            for (std::uint32_t i = 0; i < out.size(); ++i)
-            {
-              out[i] = distribution[i];
-
-              for (const peak_t& peak : new_peaks)
-              {
-                const double offset = std::abs(peak.position - dist_vals[i]) / peak.width;
-
-                out[i] -= peak.magnitude * std::exp(-pow<2>(offset));
-              }
-            }
-
-            return out;
-          }();
-
-          const auto max_idx = static_cast<std::uint32_t>(std::max_element(residuals.begin(), residuals.end()) - residuals.begin());
-
-          const double position = dist_vals[max_idx];
-
-          const double magnitude = residuals[max_idx];
-
-          double best_fit = std::numeric_limits<double>::infinity();
-
-          double best_width = random::fast(uniform_distribution(2.5, span));
-
-          for (auto _ = 500; _--;)
-          {
-            const double width = best_width * random::fast(uniform_distribution(9.0/10.0, 10.0/9.0));
-
-            double fit{};
-
-            for (std::uint32_t i = 0; i < bucket_count; ++i)
-            {
-              const double offset = std::abs(position - dist_vals[i]) / width;
-
-              const double val = magnitude * std::exp(-pow<2>(offset));
+        std::array<double, bucket_count> out;
 
-              fit += pow<2>(val - residuals[i]);
-            }
+        for (std::uint32_t i = 0; i < out.size(); ++i)
+          out[i] = min + static_cast<double>(i) / static_cast<double>(bucket_count - 1) * span;
 
-            if (fit < best_fit)
-            {
-              best_fit = fit;
+        return out;
+      }();
 
-              best_width = width;
-            }
-          }
+      // inputs to the fit, and any result kept for them
+      const std::uint64_t key = hasher{}.add(fitter_version).add(std::span<const double>{vec}).add(engine).add(bucket_count).add(fine_bucket_count).add(spread).digest();
 
-          if (best_fit == std::numeric_limits<double>::infinity())
-            fmt::print(fmt::emphasis::bold | fg(fmt::color::red), "ERROR: no change in best_fit when attempting to add a new curve\n");
-          else
-            new_peaks.emplace_back(position, magnitude, best_width);
-        }
+      const std::optional<std::vector<peak_t>> cached = results.find(key);
 
-        return new_peaks;
-      };
+      if (cached)
+        fmt::print("{}: {} peaks loaded from the result cache\n", cols[n].first, cached->size());
 
-      auto evaluate_fit = [&](const auto new_peaks)
+      // fit with the chosen engine(s), recording how each performs
+      const std::vector<peak_t> peaks = cached ? *cached : [&]
       {
-        double fit{};
+        std::vector<std::pair<std::string_view, fit_result>> engine_results{};
 
-        for (std::uint32_t i = 0; i < distribution.size(); ++i)
+        auto run = [&](const std::string_view engine_name, auto engine_func)
         {
-          double val{};
+          const auto start = std::chrono::steady_clock::now();
 
-          for (const peak_t& peak : new_peaks)
-          {
-            const double offset = std::abs(peak.position - dist_vals[i]) / peak.width;
+          engine_results.emplace_back(engine_name, engine_func());
 
-            val += peak.magnitude * std::exp(-pow<2>(offset));
-          }
+          const std::chrono::duration<double> time = std::chrono::steady_clock::now() - start;
 
-          fit += pow<2>(val - distribution[i]);
-        }
+          const auto& result = engine_results.back().second;
 
-        return fit;
-      };
+          const std::string line{fmt::format("{} {}: {} peaks, fit {}, {} evaluations, {}s\n", cols[n].first, engine_name, result.peaks.size(), result.fit, result.evaluations, time.count())};
 
-      double best_fit{std::numeric_limits<double>::infinity()};
+          fmt::print("{}", line);
 
-      for (int i = 0; i < 50000; ++i)
-      //for (int i = 0; i < 200000; ++i)
-      //for (int i = 0; i < 5000; ++i)
-      {
-        const auto new_peaks = generate_new_peaks();
+          const std::scoped_lock lock(benchmark_mutex);
 
-        const double new_fit = evaluate_fit(new_peaks);
+          benchmark << line;
+          benchmark.flush();
+        };
 
-        if (new_fit >= best_fit)
-          continue;
+        if (engine != fit_engine::lm)
+          run("random search", [&]{ return fit_random_search(distribution, grid, shared_loop); });
 
-        best_fit = new_fit;
+        if (engine != fit_engine::random)
+          run("levenberg-marquardt", [&]{ return fit_levenberg_marquardt(distribution, grid); });
 
-        peaks = std::move(new_peaks);
-      }
+        const std::vector<peak_t> best = std::ranges::min(engine_results, {}, [](const auto& result){ return result.second.fit; }).second.peaks;
+
+        results.store(key, best);
+
+        return best;
+      }();
 
       fmt::print("{} peaks:\n", peaks.size());
 
@@ -293,86 +189,58 @@ auto fit()
         fmt::print("{}\n", peak);
 
 
+      const std::string plot_path{fmt::format("cache/graph_{}.png", cols[n].first)};
+
+      // plotted afresh unless this is a cached result whose plot was kept too
+      if (!cached || !results.copy_plot(key, plot_path))
       {
-        const std::scoped_lock lock(canvas_mutex);
+        using namespace plotting;
 
-        TMultiGraph mgraph{};
+        plot p{plot_path, std::string{cols[n].first}, {}, {}};
+
+        p.copy_path = results.plot_path(key);
 
         // graph of distribution
         {
-          auto graph{std::make_unique<TGraph>()};
-
-          graph->SetLineColor(kRed);
-          graph->SetLineWidth(2);
+          line& l = p.lines.emplace_back(std::vector<std::pair<double, double>>{}, red, 2);
 
           for (std::uint32_t i = 0; i < distribution.size(); ++i)
-            graph->AddPoint(dist_vals[i], distribution[i]);
-
-          mgraph.Add(graph.release());
+            l.points.emplace_back(dist_vals[i], distribution[i]);
         }
 
         // graph of fit
         {
-          auto graph{std::make_unique<TGraph>()};
+          line& l = p.lines.emplace_back(std::vector<std::pair<double, double>>{}, blue, 2);
 
-          graph->SetLineColor(kBlue);
-          graph->SetLineWidth(2);
+          std::array<double, bucket_count> vals;
 
-          for (std::uint32_t i = 0; i < distribution.size(); ++i)
-          {
-            double val{};
-
-            for (const peak_t& peak : peaks)
-            {
-              const double offset = std::abs(peak.position - dist_vals[i]) / peak.width;
-
-              val += peak.magnitude * std::exp(-pow<2>(offset));
-            }
+          evaluate_mixture(vals, grid, peaks);
 
-            graph->AddPoint(dist_vals[i], val);
-          }
-
-          mgraph.Add(graph.release());
+          for (std::uint32_t i = 0; i < distribution.size(); ++i)
+            l.points.emplace_back(dist_vals[i], vals[i]);
         }
 
         // graph of underlying gaussians
         for (const peak_t& peak : peaks)
         {
-          auto graph{std::make_unique<TGraph>()};
-
-          graph->SetLineColor(kBlack);
-          graph->SetLineWidth(1);
+          line& l = p.lines.emplace_back(std::vector<std::pair<double, double>>{}, black, 1);
 
           for (std::uint32_t i = 0; i < distribution.size(); ++i)
           {
             const double offset = std::abs(peak.position - dist_vals[i]) / peak.width;
 
-            graph->AddPoint(dist_vals[i], peak.magnitude * std::exp(-pow<2>(offset)));
+            l.points.emplace_back(dist_vals[i], peak.magnitude * std::exp(-pow<2>(offset)));
           }
-
-          mgraph.Add(graph.release());
         }
 
         // graph marking centers of underlying gaussians
         for (const peak_t& peak : peaks)
-        {
-          auto graph{std::make_unique<TGraph>()};
-
-          graph->SetLineColor(kBlack);
-          graph->SetLineWidth(4);
-
-          graph->AddPoint(peak.position, 0);
-          graph->AddPoint(peak.position, peak.magnitude);
-
-          mgraph.Add(graph.release());
-        }
+          p.lines.emplace_back(std::vector<std::pair<double, double>>{{peak.position, 0}, {peak.position, peak.magnitude}}, black, 4);
 
-        mgraph.Draw("a");
-
-        canvas->SaveAs(fmt::format("cache/graph_{}.png", cols[n]).c_str());
+        plots.submit(std::move(p));
       }
 
-      fmt::print("finished with variable {} ({}/{})\n\n", cols[n], n + 1, cols.size());
+      fmt::print("finished with variable {} ({}/{})\n\n", cols[n].first, n + 1, cols.size());
     }
   };
 
@@ -386,8 +254,21 @@ auto fit()
   }
 }
 
-int main()
+int main(int argc, char* argv[])
 {
-  fit();
+  const std::string_view engine{argc > 1 ? argv[1] : "random"};
+
+  if (argc > 2 || (engine != "random" && engine != "lm" && engine != "both"))
+  {
+    fmt::print("usage: {} [random | lm | both]\n\n", argv[0]);
+    fmt::print("  random to fit by random search (the default)\n");
+    fmt::print("  lm to fit by levenberg-marquardt\n");
+    fmt::print("  both to fit each variable with both, plotting the better fit\n\n");
+    fmt::print("  the time, evaluations and fit of each engine on each variable are recorded in cache/fit_engines.txt\n");
+
+    return EXIT_FAILURE;
+  }
+
+  fit(engine == "random" ? fit_engine::random : engine == "lm" ? fit_engine::lm : fit_engine::both);
 }
 
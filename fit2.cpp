@@ -1,11 +1,13 @@
 #include "root.hpp"
-
-#include "TCanvas.h"
-#include "TGraph.h"
-#include "TMultiGraph.h"
-#include "TLatex.h"
-
-#include "timeblit/random.hpp"
+#include "recombination.hpp"
+#include "column_cache.hpp"
+#include "fitting.hpp"
+#include "chain_search.hpp"
+#include "em.hpp"
+#include "histogram.hpp"
+#include "result_cache.hpp"
+#include "kde.hpp"
+#include "plotting.hpp"
 
 #include <fmt/format.h>
 #include <fmt/compile.h>
@@ -20,48 +22,17 @@
 #include <charconv>
 #include <iostream>
 #include <barrier>
+#include <optional>
+#include <unordered_set>
+#include <random>
+#include <chrono>
+#include <numeric>
+#include <atomic>
+#include <filesystem>
 
 using namespace movency;
 
 
-// x to the power of non-negative integer P
-template<std::size_t P>
-[[nodiscard]] constexpr auto pow(auto x) -> decltype(x)
-{
-  if constexpr (P == 0)
-    return 1;
-  else if constexpr (P % 2 == 0)
-    return pow<P/2>(x) * pow<P/2>(x);
-  else
-    return x * pow<P/2>(x) * pow<P/2>(x);
-}
-
-
-
-struct peak_t
-{
-  double position;
-  double magnitude;
-  double width;
-};
-
-template <>
-struct fmt::formatter<peak_t>
-{
-  constexpr auto parse(format_parse_context& ctx)
-  {
-    return ctx.end();
-  }
-
-  template<class FormatContext>
-  auto format(const peak_t& p, FormatContext& ctx)
-  {
-    return fmt::format_to(ctx.out(), FMT_COMPILE("p:{} m:{} w:{}"), p.position, p.magnitude, p.width);
-  }
-};
-
-
-
 struct particle_info
 {
   std::string name;
@@ -182,6 +153,40 @@ auto generate_particle_lists(const std::string filepath)
 }
 
 
+// A list of particles sorted by mass, for finding the particles nearest to a given mass without searching the whole list
+struct particle_index
+{
+  std::vector<particle_info> particles; // in order of increasing mass
+
+  explicit particle_index(std::vector<particle_info> list) : particles{std::move(list)}
+  {
+    std::ranges::sort(particles, std::ranges::less{}, &particle_info::mass);
+  }
+
+  // call func(particle, distance) on each particle with mass within max_distance of mass, in order of increasing distance
+  // found by binary search, then by stepping outwards to whichever neighbour is nearer
+  void for_nearest(const double mass, const double max_distance, auto func) const
+  {
+    auto above = std::ranges::lower_bound(particles, mass, std::ranges::less{}, &particle_info::mass);
+    auto below = above; // particles before below are yet to be visited
+
+    while (true)
+    {
+      const double above_distance = above != particles.end()   ? above->mass - mass            : std::numeric_limits<double>::infinity();
+      const double below_distance = below != particles.begin() ? mass - std::prev(below)->mass : std::numeric_limits<double>::infinity();
+
+      if (std::min(above_distance, below_distance) > max_distance)
+        return;
+
+      if (above_distance <= below_distance)
+        func(*above++, above_distance);
+      else
+        func(*--below, below_distance);
+    }
+  }
+};
+
+
 enum class daughter {z, e, mu, pi, k, p};
 
 // Read variable name and return array of daughters represented by variable
@@ -227,49 +232,384 @@ struct peak_record
   std::string   name;
 };
 
+
+// How remove_peak decides which candidate decay (if any) to remove each iteration
+struct acceptance_policy
+{
+  bool                     automatic{false};                                // accept the best permitted candidate without asking
+  double                   min_score{0};                                    // candidates scoring below this are rejected
+  int                      max_iterations{std::numeric_limits<int>::max()}; // rounds of fitting before finishing
+  std::vector<std::string> allow{};                                         // if not empty, only these particles may be accepted
+  std::vector<std::string> deny{};                                          // these particles are never accepted
+};
+
+
+// A candidate decay considered by remove_peak, and what was decided
+struct decision
+{
+  int           iteration;
+  std::uint32_t graph_idx;
+  std::string   name;
+  double        score;
+  bool          accepted;
+  std::string   reason;
+};
+
+
+// Binary checkpoint of the state carried between iterations of fit(), so that a run can be resumed after it ends
+//
+// Layout: magic, version, then the iteration, event weights, each variable's name and peaks, and the decisions made so far.
+// Sizes are stored as std::uint64_t, and everything is in native byte order (checkpoints are not meant to be portable).
+// Variables are matched by name when resuming, as reading them from cache/mass.root rather than computing them also
+// gives a UID column (and could give the columns in another order).
+namespace checkpoint
+{
+constexpr std::string_view path{"cache/fit2_checkpoint.bin"};
+
+constexpr std::array<char, 8> magic{'f', 'i', 't', '2', 'c', 'k', 'p', 't'};
+
+constexpr std::uint32_t version{2};
+
+using variable_names = std::span<const std::pair<std::string_view, std::uint64_t>>;
+
+// write the state to a temporary file, then rename it over any previous checkpoint (so one always exists intact)
+inline void write(const int iteration, const std::span<const double> weights, const variable_names names, const std::span<const std::vector<peak_t>> peak_sets, const std::span<const decision> decisions)
+{
+  const std::string temporary_path{fmt::format("{}.tmp", path)};
+
+  {
+    std::ofstream out{temporary_path, std::ios::binary};
+
+    auto put = [&](const auto& val)
+    {
+      out.write(reinterpret_cast<const char*>(&val), sizeof(val));
+    };
+
+    auto put_span = [&](const auto vals)
+    {
+      put(static_cast<std::uint64_t>(vals.size()));
+
+      out.write(reinterpret_cast<const char*>(vals.data()), static_cast<std::streamsize>(vals.size_bytes()));
+    };
+
+    put(magic);
+    put(version);
+    put(iteration);
+
+    put_span(weights);
+
+    put(static_cast<std::uint64_t>(peak_sets.size()));
+
+    for (std::size_t n = 0; n < peak_sets.size(); ++n)
+    {
+      put_span(std::span{names[n].first});
+      put_span(std::span{peak_sets[n]});
+    }
+
+    put(static_cast<std::uint64_t>(decisions.size()));
+
+    for (const decision& d : decisions)
+    {
+      put(d.iteration);
+      put(d.graph_idx);
+      put(d.score);
+      put(d.accepted);
+      put_span(std::span{d.name});
+      put_span(std::span{d.reason});
+    }
+
+    if (!out)
+    {
+      fmt::print(fmt::emphasis::bold | fg(fmt::color::red), "ERROR: failed to write checkpoint {}\n", temporary_path);
+
+      std::exit(1);
+    }
+  }
+
+  if (std::rename(temporary_path.c_str(), std::string{path}.c_str()))
+  {
+    fmt::print(fmt::emphasis::bold | fg(fmt::color::red), "ERROR: failed to rename checkpoint {} to {}\n", temporary_path, path);
+
+    std::exit(1);
+  }
+}
+
+// read the state back, checking that it matches the expected number of events, and matching variables by name
+// (a variable missing from the checkpoint starts without peaks; one missing from names must have neither peaks nor decisions)
+inline void read(int& iteration, std::vector<double>& weights, const variable_names names, std::vector<std::vector<peak_t>>& peak_sets, std::vector<decision>& decisions)
+{
+  std::ifstream in{std::string{path}, std::ios::binary};
+
+  auto fail = [&](const std::string_view reason)
+  {
+    fmt::print(fmt::emphasis::bold | fg(fmt::color::red), "ERROR: cannot resume from checkpoint {}: {}\n", path, reason);
+
+    std::exit(1);
+  };
+
+  auto get = [&]<class T>(T& val)
+  {
+    if (!in.read(reinterpret_cast<char*>(&val), sizeof(val)))
+      fail("file is truncated");
+  };
+
+  auto get_size = [&]
+  {
+    std::uint64_t size;
+
+    get(size);
+
+    return size;
+  };
+
+  auto get_vector = [&]<class T>(std::vector<T>& vals, const std::uint64_t size)
+  {
+    vals.resize(size);
+
+    if (!in.read(reinterpret_cast<char*>(vals.data()), static_cast<std::streamsize>(size * sizeof(T))))
+      fail("file is truncated");
+  };
+
+  auto get_string = [&](std::string& str)
+  {
+    str.resize(get_size());
+
+    if (!in.read(str.data(), static_cast<std::streamsize>(str.size())))
+      fail("file is truncated");
+  };
+
+  if (!in)
+    fail("file cannot be opened");
+
+  std::remove_const_t<decltype(magic)> file_magic;
+  std::uint32_t                        file_version;
+
+  get(file_magic);
+  get(file_version);
+
+  if (file_magic != magic || file_version != version)
+    fail("not a checkpoint of this version");
+
+  get(iteration);
+
+  if (get_size() != weights.size())
+    fail("number of events differs");
+
+  get_vector(weights, weights.size());
+
+  // index into names of each variable in the checkpoint, if present
+  std::vector<std::optional<std::uint32_t>> indexes(get_size());
+
+  for (auto& index : indexes)
+  {
+    std::string         name;
+    std::vector<peak_t> peaks;
+
+    get_string(name);
+    get_vector(peaks, get_size());
+
+    const auto it = std::ranges::find(names, name, [](const auto& n){ return n.first; });
+
+    if (it == names.end())
+    {
+      if (!peaks.empty())
+        fail(fmt::format("variable {} has peaks but is not present", name));
+
+      continue;
+    }
+
+    index = static_cast<std::uint32_t>(it - names.begin());
+
+    peak_sets[*index] = std::move(peaks);
+  }
+
+  decisions.resize(get_size());
+
+  for (decision& d : decisions)
+  {
+    get(d.iteration);
+    get(d.graph_idx);
+    get(d.score);
+    get(d.accepted);
+    get_string(d.name);
+    get_string(d.reason);
+
+    if (d.graph_idx >= indexes.size() || !indexes[d.graph_idx])
+      fail(fmt::format("a decision on {} refers to a variable not present", d.name));
+
+    d.graph_idx = *indexes[d.graph_idx];
+  }
+}
+} // namespace checkpoint
+
   
-auto fit()
+// Adds the time between its construction and destruction to total
+struct scoped_timer
+{
+  std::atomic<double>&                  total;
+  std::chrono::steady_clock::time_point start{std::chrono::steady_clock::now()};
+
+  ~scoped_timer()
+  {
+    total.fetch_add(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count(), std::memory_order_relaxed);
+  }
+};
+
+
+auto fit(const acceptance_policy& policy, const bool resume, const std::size_t chain_count)
 {
   // first list has particles of charge 0; second has particles of charge +-1
   const auto lists{generate_particle_lists("../data/ParticleTable.txt")};
 
   fmt::print("\nLists created. Sizes(charge): {}(0) {}(+-1)\n\n", lists[0].size(), lists[1].size());
 
-  const std::size_t thread_count{std::max(1u, std::thread::hardware_concurrency() - 1)};
-  //const std::size_t thread_count{1};
+  const std::array<particle_index, 2> particle_indexes{particle_index{lists[0]}, particle_index{lists[1]}};
+
+  // each variable's values as floats: read through a column_cache if generate_recombinations has written
+  // cache/mass.root, otherwise computed from the daughters' momenta whenever needed
+  std::optional<column_cache>                stored_columns{};
+  std::optional<recombination::mass_columns> computed_columns{};
+
+  if (std::filesystem::exists("cache/mass.root"))
+  {
+    fmt::print("reading variables from cache/mass.root\n");
 
-  auto canvas = std::make_unique<TCanvas>("canvas", "canvas", 1500, 950); //make before creation of r to avert root segfault (magic!)
+    stored_columns.emplace("cache/mass.root");
+  }
+  else
+  {
+    computed_columns.emplace();
+  }
 
-  const movency::root::file r("cache/mass.root");
+  const auto& cols = stored_columns ? stored_columns->names() : computed_columns->names();
 
-  //fmt::print("read\n");
+  const auto event_count = stored_columns ? stored_columns->entries() : computed_columns->entries();
 
-  const auto cols = r.get_names();
+  // values of variable n: a view of the cache's mapping, or else computed into buffer (which callers reuse between columns)
+  const auto column = [&](const std::size_t n, std::vector<float>& buffer) -> std::span<const float>
+  {
+    if (stored_columns)
+      return (*stored_columns)[n];
 
-  const auto event_count = r.uncompress<double>(cols.front().first).size();
+    return computed_columns->column(n, buffer);
+  };
+
+  constexpr std::size_t column_block_size{1 << 12}; // events in each block of a column read by column_block
+
+  // values of variable n for events [from, from + count) (at most column_block_size): a view of the cache's mapping, or
+  // else computed into block
+  const auto column_block = [&](const std::size_t n, const std::size_t from, const std::size_t count, std::array<float, column_block_size>& block) -> std::span<const float>
+  {
+    if (stored_columns)
+      return (*stored_columns)[n].subspan(from, count);
+
+    return computed_columns->block(n, from, std::span{block}.first(count));
+  };
+
+  constexpr int bucket_count{1000}; // buckets in each density
+
+  constexpr std::size_t fine_bucket_count{16384}; // bins events are sorted into before smoothing
 
   std::vector<double> weights(event_count, 1); // Weight to give each event when constructing distribution
 
-  std::vector<std::vector<peak_t>> peak_sets(event_count);
+  std::vector<std::vector<peak_t>> peak_sets(cols.size());
+
+  // fine histogram of each variable, built on its first round then kept up to date from the changes to weights
+  std::vector<std::optional<incremental_histogram<fine_bucket_count>>> histograms(cols.size());
+
+  // density of each variable (smoothed from its fine histogram) that its peaks are fitted to
+  std::vector<histogram_t<bucket_count>> densities(cols.size());
+
+  std::vector<weight_change> weight_changes{}; // made by the most recent call to remove_peak, in order of event
+
+  std::optional<std::size_t> reweighted_variable{}; // whose histogram the most recent call to remove_peak already updated
 
   std::vector<std::vector<peak_record>> best_local_peaks(thread_count); // score, event idx, peak idx, peak name
 
-  std::mutex canvas_mutex;
+  // renders and writes the graph of each variable's fit, without holding up the fitting threads
+  plotting::plotter plots{2};
+
+  std::atomic<std::uint32_t> next{0}; // next work item: chain (next % chain_count) of variable (next / chain_count)
+
+  // each variable's histogram and density are brought up to date once per iteration, by whichever of its chains gets there first
+  auto histogram_ready = std::make_unique<std::once_flag[]>(cols.size());
 
-  std::atomic<std::uint32_t> next{0};
+  // result of each chain of each variable, and how many of each variable's chains have finished this iteration
+  std::vector<std::vector<fit_result>> chain_results(cols.size(), std::vector<fit_result>(chain_count));
 
-  constexpr int bucket_count{1000}; // buckets in each histogram
+  std::vector<std::atomic<std::size_t>> chains_finished(cols.size());
 
-  constexpr double spread{2.0}; // how far each point should bleed into neighbouring buckets (linearly)
+  // time spent on each variable this iteration; each iteration takes the variables slowest in the last one first, so
+  // that the longest fits are not left running alone at the end
+  std::vector<std::atomic<double>> variable_times(cols.size());
+
+  std::vector<std::uint32_t> order(cols.size());
+
+  std::iota(order.begin(), order.end(), 0u);
+
+  // lets threads that have run out of variables help with the fits still running
+  work_sharing sharing{thread_count};
+
+  // runs independent pieces of a variable's work (density convolutions, width searches), sharing them once threads run out of variables
+  const auto shared_loop = [&](const std::size_t count, const auto& func){ sharing.share(count, func); };
+
+  // results of earlier runs, keyed by a hash of everything a variable's fit depends on, so unchanged fits are not redone
+  const result_cache results{};
+
+  constexpr std::uint32_t fitter_version{3}; // bump whenever a change to fitting alters its results, so older results are not reused
+
+  std::vector<std::uint64_t> column_hashes(cols.size()); // of each variable's values, hashed when first read
+
+  std::vector<std::uint64_t> result_keys(cols.size()); // of each variable's fit this iteration
+
+  std::vector<std::optional<std::vector<peak_t>>> cached_results(cols.size()); // found for each variable this iteration
+
+  constexpr double spread{2.0}; // densities are scaled to match histograms in which each event bled this many buckets either side (linearly)
 
   int iteration = 0;
 
-  std::ofstream log{"cache/log.txt"};
+  std::vector<decision> decisions{};
+
+  if (resume)
+  {
+    checkpoint::read(iteration, weights, cols, peak_sets, decisions);
+
+    fmt::print("Resuming at iteration {}, after {} decisions\n", iteration, decisions.size());
+  }
+
+  std::uint64_t weights_hash = hasher{}.add(std::span<const double>{weights}).digest();
+
+  // continued rather than replaced when resuming
+  const auto log_mode = resume ? std::ios::app : std::ios::trunc;
+
+  std::ofstream log{"cache/log.txt", log_mode};
+
+  std::ofstream decision_log{"cache/decisions.txt", log_mode};
+
+  std::ofstream stability_log{"cache/stability.txt", log_mode};
+
+  std::mutex stability_mutex;
+
+  bool finished{false}; // set by remove_peak once no further iterations are to be made
 
   auto remove_peak = [&]
   {
     next = 0;
 
+    histogram_ready = std::make_unique<std::once_flag[]>(cols.size());
+
+    for (auto& count : chains_finished)
+      count = 0;
+
+    std::ranges::stable_sort(order, std::ranges::greater{}, [&](const std::uint32_t n){ return variable_times[n].load(); });
+
+    for (auto& time : variable_times)
+      time = 0;
+
+    sharing.reset();
+
+    reweighted_variable.reset();
+
     std::vector<peak_record> best_peaks{};
     
     best_peaks.reserve(25 * thread_count);
@@ -279,121 +619,178 @@ auto fit()
 
     std::ranges::sort(best_peaks, [](const auto& lhs, const auto& rhs){ return lhs.score > rhs.score; });
 
-    for (std::uint32_t i = 0; true; ++i)
+    if (iteration + 1 >= policy.max_iterations)
+    {
+      fmt::print("Reached the maximum of {} iterations\n", policy.max_iterations);
+
+      finished = true;
+
+      return;
+    }
+
+    // decide on a candidate, recording the decision (candidates failing the policy are rejected without asking)
+    auto decide = [&](const peak_record& candidate)
     {
-      if (i > 25)
-        fmt::print("WARNING: exceeded 25 potential peaks\n");
+      decision& d = decisions.emplace_back(iteration, candidate.graph_idx, candidate.name, candidate.score, false, "");
+
+      if (candidate.score < policy.min_score)
+        d.reason = "score below minimum";
+      else if (std::ranges::find(policy.deny, candidate.name) != policy.deny.end())
+        d.reason = "particle denied";
+      else if (!policy.allow.empty() && std::ranges::find(policy.allow, candidate.name) == policy.allow.end())
+        d.reason = "particle not allowed";
+      else if (policy.automatic)
+      {
+        d.accepted = true;
+        d.reason   = "accepted automatically";
+      }
+      else
+      {
+        fmt::print("use decay: {} -> {} ? [y/n]\n", candidate.name, cols[candidate.graph_idx].first);
+
+        char in;
 
-      fmt::print("use decay: {} -> {} ? [y/n]\n", best_peaks[i].name, cols[best_peaks[i].graph_idx].first);
+        std::cin >> in;
 
-      char in;
+        d.accepted = in == 'y';
+        d.reason   = d.accepted ? "accepted by user" : "rejected by user";
+      }
 
-      std::cin >> in;
+      decision_log << fmt::format("iteration {}: {} {} -> {} (score {}): {}\n", d.iteration, d.accepted ? "accept" : "reject", d.name, cols[d.graph_idx].first, d.score, d.reason);
+      decision_log.flush();
 
-      if (in == 'y')
+      return d.accepted;
+    };
+
+    bool accepted{false};
+
+    // records left with a score of 0 are unfilled
+    for (std::uint32_t i = 0; i < best_peaks.size() && best_peaks[i].score > 0; ++i)
+    {
+      if (decide(best_peaks[i]))
       {
-        const peak_t& peak = peak_sets[best_peaks[i].graph_idx][best_peaks[i].peak_idx];
+        accepted = true;
+
+        const std::uint32_t graph_idx = best_peaks[i].graph_idx;
 
-        log << fmt::format("removing decay: {} -> {}   (peak: {})\n", best_peaks[i].name, cols[best_peaks[i].graph_idx].first, peak);
+        const peak_t& peak = peak_sets[graph_idx][best_peaks[i].peak_idx];
+
+        log << fmt::format("removing decay: {} -> {}   (peak: {})\n", best_peaks[i].name, cols[graph_idx].first, peak);
         log.flush();
 
         fmt::print("PEAK: {}\n", peak);
 
-        const std::vector<double> vec = r.uncompress<double>(cols[best_peaks[i].graph_idx].first);
+        std::vector<float> buffer{};
 
-        const auto min = std::ranges::min(vec);
-        const auto max = std::ranges::max(vec);
+        const std::span<const float> vec = column(graph_idx, buffer);
 
-        const auto span = max - min;
+        // up to date, as weights have not changed since the variable was fitted this round
+        const histogram_t<bucket_count>& density = densities[graph_idx];
 
-        const auto dist_vals = [&]
-        {
-          std::array<double, bucket_count> out;
+        const grid_t& grid = density.grid;
 
-          for (std::uint32_t j = 0; j < out.size(); ++j)
-            out[j] = min + static_cast<double>(j) / static_cast<double>(bucket_count - 1) * span;
+        const auto& distribution = density.values;
 
-          return out;
-        }();
+        double distribution_total{0};
 
-        // distribution of values
-        const auto distribution = [&]
-        {
-          std::array<double, bucket_count> out{};
+        for (const double d : distribution)
+          distribution_total += d;
 
-          for (std::size_t j = 0; j < event_count; ++j)
-          {
-            const double distance = (vec[j] - min) / span * static_cast<double>(bucket_count - 1);
+        // refit the variable's peaks (with a smooth background) directly to the weighted events
+        const em_result em = fit_em<float>(vec, weights, seed_components(peak_sets[graph_idx], grid.step, distribution_total));
 
-            const auto from = static_cast<std::uint32_t>(std::max(0,          static_cast<std:: int32_t>(distance - spread)    ));
-            const auto to   = static_cast<std::uint32_t>(std::min(out.size(), static_cast<std::uint64_t>(distance + spread) + 1));
+        fmt::print("EM PEAK: {} ({} iterations, log likelihood {})\n", em.to_peak(best_peaks[i].peak_idx, grid.step, distribution_total), em.iterations, em.log_likelihood);
 
-            for (std::uint32_t k = from; k < to; ++k)
-              out[k] += weights[j] * std::max(0.0, spread - std::abs(dist_vals[k] - min) / span);
-          }
+        // events are reweighted in parallel over chunks (each thread taking every thread_count'th chunk, so results do
+        // not depend on timing), a simd vector at a time; the changes are recorded, and scattered straight into the
+        // reweighted variable's own histogram rather than applied to it next round
+        // (changes too small to matter are discarded, so each event's weight stays consistent with the histograms)
+        constexpr std::size_t chunk_size{1 << 14};
 
-          return out;
-        }();
+        const std::size_t chunk_count = (event_count + chunk_size - 1) / chunk_size;
+
+        std::vector<std::vector<weight_change>> chunk_changes(chunk_count);
+
+        incremental_histogram<fine_bucket_count>& histogram = *histograms[graph_idx];
 
-        for (std::uint32_t j = 0; j < event_count; ++j)
+        std::vector<std::array<double, fine_bucket_count>> thread_histograms(thread_count);
+
+        do_threaded([&](const std::uint32_t thread_index)
         {
-          const double distance = (vec[j] - min) / span * static_cast<double>(bucket_count - 1);
+          std::array<double, fine_bucket_count>& partial = thread_histograms[thread_index];
 
-          const auto below = static_cast<std::uint32_t>(std::floor(distance));
-          const auto above = static_cast<std::uint32_t>(std::ceil (distance));
+          partial.fill(0);
 
-          if (distance > distribution.size() - 1 || distance < 0)
+          for (std::size_t chunk = thread_index; chunk < chunk_count; chunk += thread_count)
           {
-            fmt::print("ERROR: {} {} {} {}", distance, distribution.size(), above, below);
-            int pauspdsiubf;
-            std::cin >> pauspdsiubf;
-            continue;
-          }
+            const std::size_t from = chunk * chunk_size;
+            const std::size_t to   = std::min(event_count, from + chunk_size);
 
-          const double background = (distance - below) * distribution[above] + (above - distance) * distribution[below];
+            for (std::size_t j = from; j < to; j += simd::width)
+            {
+              simd::doubles x{};
 
-          const double signal = [&]
-          {
-            double out = 0;
+              for (std::size_t l = 0; l < simd::width; ++l)
+                x[l] = static_cast<double>(vec[std::min(j + l, to - 1)]);
 
-            const double offset_1 = std::abs(peak.position - dist_vals[above]) / peak.width;
+              const simd::doubles kept = 1.0 - em.responsibility(best_peaks[i].peak_idx, x);
 
-            out += (distance - below) * peak.magnitude * std::exp(-pow<2>(offset_1));
+              for (std::size_t l = 0; l < simd::width && j + l < to; ++l)
+              {
+                const double delta = weights[j + l] * kept[l] - weights[j + l];
 
-            const double offset_2 = std::abs(peak.position - dist_vals[below]) / peak.width;
+                if (std::abs(delta) > 1e-9 * weights[j + l])
+                {
+                  weights[j + l] += delta;
 
-            out += (above - distance) * peak.magnitude * std::exp(-pow<2>(offset_2));
+                  chunk_changes[chunk].emplace_back(j + l, delta);
 
-            return out;
-          }();
+                  histogram_setup::scatter(partial, histogram.distance(vec[j + l]), histogram.spread, delta);
+                }
+              }
+            }
+          }
+        });
 
-          if (background != 0)
-            weights[j] *= (background - signal) / background;
-          else
-            fmt::print(fmt::emphasis::bold | fg(fmt::color::red), "{} ({}): {}, {} {} {}  {}\n", j, vec[j], weights[j], background, signal, background - signal, (background - signal) / background);
+        weight_changes.clear();
 
-          //if (weights[j] != weights[j])
-          //if (background == 0)
-            //fmt::print(fmt::emphasis::bold | fg(fmt::color::red), "{}: {}, {} {} {}  {}\n", j, weights[j], background, signal, background - signal, (background - signal) / background);
+        for (const auto& changes : chunk_changes)
+          weight_changes.insert(weight_changes.end(), changes.begin(), changes.end());
 
-          if (weights[j] < 0 || weights[j] > 1)
-            fmt::print("*** {} {} {} {} {} {}\n", weights[j], vec[j], below, above, background, signal);
+        for (const auto& partial : thread_histograms)
+          for (std::size_t k = 0; k < fine_bucket_count; ++k)
+            histogram.values[k] += partial[k];
 
-          //if (j < 10000)
-            //fmt::print("*** {} {} {} {} {} {}\n", weights[j], vec[j], below, above, background, signal);
-        }
+        reweighted_variable = graph_idx;
+
+        fmt::print("{} of {} event weights changed\n", weight_changes.size(), event_count);
 
         break;
       }
     }
 
+    if (!accepted)
+    {
+      fmt::print("No candidate decay accepted after {} iterations: finishing\n", iteration + 1);
+
+      finished = true;
+    }
+
+    weights_hash = hasher{}.add(std::span<const double>{weights}).digest();
+
     ++iteration;
+
+    checkpoint::write(iteration, weights, cols, peak_sets, decisions);
   };
 
   std::barrier sync_point(static_cast<std::ptrdiff_t>(thread_count), remove_peak);
 
   auto loop = [&](const auto thread_no)
   {
+    // reused for the columns this thread reads
+    std::vector<float>                   column_buffer{};
+    std::array<float, column_block_size> block_buffer;
+
     while (true)
     {
       best_local_peaks[thread_no].resize(25);
@@ -403,11 +800,16 @@ auto fit()
 
       while (true)
       {
-        const auto n = next.fetch_add(1, std::memory_order_relaxed);
+        const auto item = next.fetch_add(1, std::memory_order_relaxed);
 
-        if (n >= cols.size())
+        if (item >= cols.size() * chain_count)
           break;
 
+        const auto n     = order[item / chain_count];
+        const auto chain = static_cast<std::uint32_t>(item % chain_count);
+
+        const scoped_timer item_timer{variable_times[n]};
+
         const auto daughters = get_daughters(cols[n].first);
 
         const int daughter_count = [&]
@@ -423,282 +825,141 @@ auto fit()
 
         if (daughter_count <= 1)
         {
-          fmt::print("Skipping due to too few particles: {}\n", cols[n].first);
+          if (chain == 0)
+            fmt::print("Skipping due to too few particles: {}\n", cols[n].first);
 
           continue;
         }
 
-        fmt::print("reading variable: {}\n", cols[n].first);
-
-        const std::vector<double> vec = r.uncompress<double>(cols[n].first);
-
-        if (vec.size() != event_count)
-        {
-          fmt::print(fmt::emphasis::bold | fg(fmt::color::red), "ERROR: inconsistent number of entries in each record: {} in {}; {} in {}", event_count, 0, vec.size(), 0);
-
-          std::exit(1);
-        }
-
-        if (vec.empty())
+        std::call_once(histogram_ready[n], [&]
         {
-          fmt::print(fmt::emphasis::bold | fg(fmt::color::red), "ERROR: No data present for variable {} (index n={})\n", cols[n].first, n);
-
-          std::exit(1);
-          //continue;
-        }
-
-        fmt::print("fitting variable: {}\n", cols[n].first);
-
-        const auto min = std::ranges::min(vec);
-        const auto max = std::ranges::max(vec);
-
-        const auto span = max - min;
-
-        // values represented by buckets
-        const auto dist_vals = [&]
-        {
-          std::array<double, bucket_count> out;
-
-          for (std::uint32_t i = 0; i < out.size(); ++i)
-            out[i] = min + static_cast<double>(i) / static_cast<double>(bucket_count - 1) * span;
-
-          return out;
-        }();
-
-        // distribution of values
-        const auto distribution = [&]
-        {
-          std::array<double, bucket_count> out{};
-
-          for (std::size_t j = 0; j < event_count; ++j)
+          if (!histograms[n])
           {
-            //if (iteration != 0)
-              //fmt::print("START\n\n");
-            const double distance = (vec[j] - min) / span * static_cast<double>(bucket_count - 1);
+            fmt::print("reading variable: {}\n", cols[n].first);
 
-            const auto from = static_cast<std::uint32_t>(std::max(0,          static_cast<std:: int32_t>(distance - spread)    ));
-            const auto to   = static_cast<std::uint32_t>(std::min(out.size(), static_cast<std::uint64_t>(distance + spread) + 1));
+            const std::span<const float> values = column(n, column_buffer);
 
-            for (std::uint32_t i = from; i < to; ++i)
-            {
-              out[i] += weights[j] * std::max(0.0, spread - std::abs(dist_vals[i] - min) / span);
-              //if (iteration != 0 && out[i] != out[i])
-                //fmt::print("{} {}, v{} w{} dv{} s{} d{}\n", j, i, vec[j], weights[j], dist_vals[i], span, distance);
-            }
-          }
-
-          return out;
-        }();
+            column_hashes[n] = hasher{}.add(values).digest();
 
-        std::vector<peak_t>& peaks{peak_sets[n]};
-
-        for (auto _l = 750; _l--;)
-        //for (auto _l = 1; _l--;)
-        {
-          auto calculate_residuals = [&]<bool ignore = false>(const std::size_t ignore_index = 0)
+            // values binned finely (serially, as each thread is already working on its own variable)
+            histograms[n].emplace(values, weights, 1.0);
+          }
+          else if (reweighted_variable != n && !weight_changes.empty())
           {
-            std::array<double, bucket_count> out;
-
-            //if (iteration != 0)
-              //fmt::print("START\n\n");
-
-            for (std::size_t i = 0; i < out.size(); ++i)
+            // the changed events' positions are recomputed from their values, rather than kept between rounds, a block
+            // at a time (so a computed column is only computed in the blocks holding changes)
+            for (auto change = weight_changes.begin(); change != weight_changes.end();)
             {
-              //if (iteration != 0)
-                //fmt::print("{}, {} - ", i, distribution[i]);
-
-              out[i] = distribution[i];
+              const std::size_t from = change->event / column_block_size * column_block_size;
+              const std::size_t to   = std::min(from + column_block_size, event_count);
 
-              for (std::size_t j = 0; j < peaks.size(); ++j)
-              {
-                if constexpr (ignore)
-                  if (j == ignore_index)
-                    continue;
+              const auto block_end = std::find_if(change, weight_changes.end(), [&](const weight_change& c){ return c.event >= to; });
 
-                const double offset = std::abs(peaks[j].position - dist_vals[i]) / peaks[j].width;
+              histograms[n]->apply({change, block_end}, column_block(n, from, to - from, block_buffer), from);
 
-                out[i] -= peaks[j].magnitude * std::exp(-pow<2>(offset));
-                //if (iteration != 0 && out[i] != out[i])
-                  //fmt::print("** {}   {}   {}\n", peaks[j], dist_vals[i], offset);
-              }
+              change = block_end;
             }
+          }
 
-            return out;
-          };
+          // distribution of values: an adaptive kernel density, a bucket wide where values are typical
+          const incremental_histogram<fine_bucket_count>& fine = *histograms[n];
 
-          auto calculate_fit = [&](const std::array<double, bucket_count>& residuals, const peak_t peak = {0,0,0})
-          {
-            double fit{};
+          const grid_t grid = grid_t::spanning(fine.grid.min, fine.grid[fine_bucket_count - 1], bucket_count);
 
-            //if (iteration != 0)
-            //fmt::print("START\n\n");
+          densities[n] = {grid, kernel_density<bucket_count>(fine.values, fine.grid, grid, {.bandwidth = grid.step}, shared_loop)};
 
-            for (std::uint32_t i = 0; i < bucket_count; ++i)
-            {
-              const double offset = std::abs(peak.position - dist_vals[i]) / peak.width;
+          for (double& d : densities[n].values)
+            d *= pow<2>(spread);
 
-              const double val = peak.magnitude * std::exp(-pow<2>(offset));
-            //if (iteration != 0)
-              //fmt::print("{} | {} {} {} | {} {}\n", peak, fit, offset, val, dist_vals[i], residuals[i]);
+          // inputs to this iteration's fit, and any result kept for them
+          hasher key{};
 
-              fit += pow<2>(val - residuals[i]);
-            }
+          key.add(fitter_version).add(column_hashes[n]).add(weights_hash).add(iteration).add(std::span<const peak_t>{peak_sets[n]});
+          key.add(bucket_count).add(fine_bucket_count).add(spread).add(chain_count);
 
-            return fit;
-          };
+          result_keys[n] = key.digest();
 
-          using namespace random;
+          cached_results[n] = results.find(result_keys[n]);
+        });
 
-          //if (std::ssize(peaks) > 0 && (std::ssize(peaks) > 10 || std::bernoulli_distribution(0.9)(prng_)))
-          //if (peaks.size() > 1 && std::bernoulli_distribution(1.0 - std::pow(0.4, peaks.size()))(prng_))
-          if (peaks.size() > 1 && random::fast(uniform_distribution<bool>(1.0 - std::pow(0.666, peaks.size()))))
-          {
-            // which peak to alter
-            const std::size_t change_index = random::fast(uniform_distribution(0ul, peaks.size() - 1));
+        fmt::print("fitting variable: {} (chain {})\n", cols[n].first, chain);
 
-            peak_t cpeak = peaks[change_index];
+        const histogram_t<bucket_count>& density = densities[n];
 
-            // difference between distribution and all peaks excluding the one currently under alteration
-            const auto residuals{calculate_residuals.template operator()<true>(change_index)};
+        const grid_t& grid = density.grid;
 
-            double prev_fit = calculate_fit(residuals, cpeak);
-            double new_fit  = calculate_fit(residuals);
+        const auto& distribution = density.values;
 
-            auto optimize_variable = [&]<std::uint32_t var>(double factor)
-            {
-              for (auto _ = 20; _--;)
-              {
-                const double fit0 = calculate_fit(residuals, cpeak);
-                double fit1;
-                double fit2;
+        const double min  = grid.min;
+        const double max  = grid[bucket_count - 1];
+        const double span = max - min;
 
-                double& variable = var == 0 ? cpeak.position : var == 1 ? cpeak.magnitude : cpeak.width;
+        // values represented by buckets
+        const auto dist_vals = [&]
+        {
+          std::array<double, bucket_count> out;
 
-                if constexpr (var == 0)
-                {
-                  fit1 = calculate_fit(residuals, {cpeak.position + factor, cpeak.magnitude, cpeak.width});
-                  fit2 = calculate_fit(residuals, {cpeak.position + factor + factor, cpeak.magnitude, cpeak.width});
-                }
-                else if constexpr (var == 1)
-                {
-                  fit1 = calculate_fit(residuals, {cpeak.position, cpeak.magnitude * factor, cpeak.width});
-                  fit2 = calculate_fit(residuals, {cpeak.position, cpeak.magnitude * factor * factor, cpeak.width});
-                }
-                else if constexpr (var == 2)
-                {
-                  fit1 = calculate_fit(residuals, {cpeak.position, cpeak.magnitude, cpeak.width * factor});
-                  fit2 = calculate_fit(residuals, {cpeak.position, cpeak.magnitude, cpeak.width * factor * factor});
-                }
-                //fmt::print("fits:  {}   {}   {}\n", fit0, fit1, fit2);
-                //fmt::print("{}  :  {}   {}   {}    ({})\n", var, variable, variable * factor, variable * factor * factor, factor);
+          for (std::uint32_t i = 0; i < out.size(); ++i)
+            out[i] = min + static_cast<double>(i) / static_cast<double>(bucket_count - 1) * span;
 
-                if (fit1 < fit0 && fit1 < fit2)
-                {
-                  if (fit2 < fit0)
-                  {
-                    if constexpr (var == 0)
-                      variable += factor;
-                    else
-                      variable *= factor;
-                  }
-
-                  if constexpr (var == 0)
-                    factor *= 0.5;
-                  else
-                    factor = std::sqrt(factor);
-                }
-                else
-                {
-                  if (fit1 > fit2 && fit1 > fit0)
-                    break;
-
-                  if (fit0 < fit2)
-                  {
-                    if constexpr (var == 0)
-                      variable -= factor;
-                    else
-                    {
-                      variable /= factor;
-
-                      if constexpr (var == 2)
-                        if (variable <= 0.5)
-                        {
-                          peaks.erase(peaks.begin() + static_cast<std::int64_t>(change_index));
-                          return;
-                        }
-                    }
-                  }
-
-                  if constexpr (var == 0)
-                    factor *= 1.5;
-                  else
-                    factor = std::pow(factor, 1.5);
-                }
-              }
+          return out;
+        }();
 
-              //peaks[change_index].position = cpeak.position;
-              peaks[change_index] = cpeak;
+        // a variable with a cached result is handled by its first chain alone
+        if (cached_results[n])
+        {
+          if (chain > 0)
+            continue;
+        }
+        else
+        {
+          // each chain starts from the variable's peaks of the previous iteration, with its own reproducible seed
+          std::seed_seq seed{static_cast<std::uint32_t>(iteration), n, chain};
 
-              return;
-            };
+          chain_results[n][chain] = fit_chain_search(distribution, grid, peak_sets[n], std::mt19937_64{seed}, shared_loop);
 
-            if (new_fit <= prev_fit)
-            {
-              peaks.erase(peaks.begin() + static_cast<std::int64_t>(change_index));
-            }
-            else if (random::fast(uniform_distribution<bool>(0.25)))
-            {
-              optimize_variable.template operator()<0>(random::fast(uniform_distribution(-span/500, span/500)));
-            }
-            else if (random::fast<bool>())
-            {
-              optimize_variable.template operator()<1>(random::fast(uniform_distribution(0.5, 1.5)));
-            }
-            else
-            {
-              optimize_variable.template operator()<2>(random::fast(uniform_distribution(0.5, 1.5)));
-            }
-          }
-          else
-          {
-            /*
-            peaks.emplace_back(random::fast(uniform_distribution(min, max)), 
-                                   random::fast(uniform_distribution(0.0, static_cast<double>(vec.size()) * pow<2>(spread) / bucket_count)),
-                                   random::fast(uniform_distribution(2.5, span)));
-                                   */
+          // the last of a variable's chains to finish keeps the best fit, and goes on to annotate and plot it
+          if (chains_finished[n].fetch_add(1) + 1 < chain_count)
+            continue;
+        }
+
+        std::vector<peak_t> peaks{};
+
+        if (cached_results[n])
+        {
+          peaks = *cached_results[n];
 
-            const auto residuals{calculate_residuals()};
+          fmt::print("{} iteration {}: {} peaks loaded from the result cache\n", cols[n].first, iteration, peaks.size());
+        }
+        else
+        {
+          std::vector<double> fits{};
 
-            const auto max_idx = static_cast<std::uint32_t>(std::max_element(residuals.begin(), residuals.end()) - residuals.begin());
+          for (const fit_result& result : chain_results[n])
+            fits.push_back(result.fit);
 
-            const double position = dist_vals[max_idx];
+          std::ranges::sort(fits);
 
-            const double magnitude = residuals[max_idx];
+          const fit_result& best = *std::ranges::min_element(chain_results[n], std::ranges::less{}, &fit_result::fit);
 
-            double best_fit = std::numeric_limits<double>::infinity();
+          peaks = best.peaks;
 
-            double best_width = random::fast(uniform_distribution(2.5, span));
+          results.store(result_keys[n], peaks);
 
-            for (auto _ = 500; _--;)
-            {
-              const double width = best_width * random::fast(uniform_distribution(9.0/10.0, 10.0/9.0));
+          // how much the chains disagree, as a diagnostic of how far a single chain can be trusted
+          // (relative to the best fit unless that is perfect, when only the absolute spread means anything)
+          const std::string disagreement{fits.front() > 0 ? fmt::format("{:.3}% above best", 100.0 * (fits.back() - fits.front()) / fits.front())
+                                                          : fmt::format("{} above best", fits.back() - fits.front())};
 
-              double fit{calculate_fit(residuals, {position, magnitude, width})};
+          const std::string report{fmt::format("{} iteration {}: best of {} chains fit {} with {} peaks; median fit {}, worst {} ({})\n",
+                                               cols[n].first, iteration, chain_count, fits.front(), peaks.size(), fits[fits.size() / 2], fits.back(), disagreement)};
 
-              if (fit < best_fit)
-              {
-                best_fit = fit;
+          fmt::print("{}", report);
 
-                best_width = width;
-              }
-            }
+          const std::scoped_lock lock(stability_mutex);
 
-            if (best_fit == std::numeric_limits<double>::infinity())
-              //fmt::print(fmt::emphasis::bold | fg(fmt::color::red), "ERROR: no change in best_fit when attempting to add a new curve\n");
-            {}
-            else
-              peaks.emplace_back(position, magnitude, best_width);
-          }
+          stability_log << report;
+          stability_log.flush();
         }
 
         fmt::print("finished fitting gaussians to {}, with {} peaks:\n", cols[n].first,  peaks.size());
@@ -710,9 +971,9 @@ auto fit()
 
         std::ranges::sort(peaks, std::ranges::greater{}, [](const peak_t peak){return peak.magnitude / peak.width;} );
 
-        auto local_list = lists[charge];
+        peak_sets[n] = peaks;
 
-        std::vector<std::string> particles_so_far{};
+        std::unordered_set<std::string> particles_so_far{};
 
         // list of peak indexes requiring annotation, and their names
         std::vector<std::pair<std::uint32_t, std::string>> annotations{};
@@ -726,23 +987,15 @@ auto fit()
           if (sharpness < 50)
             break;
 
-          std::ranges::sort(local_list, std::ranges::less{}, [&](const particle_info p){return std::abs(peak.position - p.mass);});
-
           bool annotated = false;
 
-          for (const particle_info& particle : local_list)
+          particle_indexes[charge].for_nearest(peak.position, 125, [&](const particle_info& particle, const double distance)
           {
             if (particle.width != std::numeric_limits<double>::infinity() && particle.width * 0.9 > peak.width * 1.665109)
-              continue; // peak too thin given particle width
-
-            const auto distance = std::abs(peak.position - particle.mass);
-
-            if (distance > 125)
-              break;
+              return; // peak too thin given particle width
 
-            //if (particles_so_far.contains(p.name))
-            if (std::ranges::find(particles_so_far, particle.name) != particles_so_far.end())
-              continue;
+            if (particles_so_far.contains(particle.name))
+              return;
 
             if (!annotated)
               if (sharpness > 125)
@@ -753,9 +1006,9 @@ auto fit()
                   annotated = true;
                 }
 
-            particles_so_far.push_back(particle.name);
+            particles_so_far.insert(particle.name);
 
-            //fmt::print("{}  (peak {}) dist {}\n", particle, peak, std::abs(peak.position - particle.mass));
+            //fmt::print("{}  (peak {}) dist {}\n", particle, peak, distance);
 
             const double score = std::log(sharpness) / (distance + 1);
 
@@ -764,69 +1017,53 @@ auto fit()
 
             std::ranges::sort(best_local_peaks[thread_no], [](const auto& lhs, const auto& rhs){ return lhs.score > rhs.score; });
             //fmt::print("*** {}  {}\n", best_local_peaks[thread_no].front().score, best_local_peaks[thread_no].back().score);
-          }
+          });
         }
 
         const std::string name{fmt::format("{}_iteration{}", cols[n].first, iteration)};
 
+        const std::string plot_path{fmt::format("cache/graph_{}.png", name)};
+
+        // plotted afresh unless this is a cached result whose plot was kept too
+        if (!cached_results[n] || !results.copy_plot(result_keys[n], plot_path))
         {
-          const std::scoped_lock lock(canvas_mutex);
+          using namespace plotting;
 
-          TMultiGraph mgraph{name.c_str(), name.c_str()};
+          plot p{plot_path, name, {}, {}};
+
+          p.copy_path = results.plot_path(result_keys[n]);
 
           // graph of distribution
           {
-            auto graph{std::make_unique<TGraph>()};
-
-            graph->SetLineColor(kRed);
-            graph->SetLineWidth(2);
+            line& l = p.lines.emplace_back(std::vector<std::pair<double, double>>{}, red, 2);
 
             for (std::uint32_t i = 0; i < distribution.size(); ++i)
-              graph->AddPoint(dist_vals[i], distribution[i]);
-
-            mgraph.Add(graph.release());
+              l.points.emplace_back(dist_vals[i], distribution[i]);
           }
 
           // graph of fit
           {
-            auto graph{std::make_unique<TGraph>()};
-
-            graph->SetLineColor(kBlue);
-            graph->SetLineWidth(2);
-
-            for (std::uint32_t i = 0; i < distribution.size(); ++i)
-            {
-              double val{};
-
-              for (const peak_t& peak : peaks)
-              {
-                const double offset = std::abs(peak.position - dist_vals[i]) / peak.width;
+            line& l = p.lines.emplace_back(std::vector<std::pair<double, double>>{}, blue, 2);
 
-                val += peak.magnitude * std::exp(-pow<2>(offset));
-              }
+            std::array<double, bucket_count> vals;
 
-              graph->AddPoint(dist_vals[i], val);
-            }
+            evaluate_mixture(vals, grid, peaks);
 
-            mgraph.Add(graph.release());
+            for (std::uint32_t i = 0; i < distribution.size(); ++i)
+              l.points.emplace_back(dist_vals[i], vals[i]);
           }
 
           // graph of underlying gaussians
           for (const peak_t& peak : peaks)
           {
-            auto graph{std::make_unique<TGraph>()};
-
-            graph->SetLineColor(kBlack);
-            graph->SetLineWidth(1);
+            line& l = p.lines.emplace_back(std::vector<std::pair<double, double>>{}, black, 1);
 
             for (std::uint32_t i = 0; i < distribution.size(); ++i)
             {
               const double offset = std::abs(peak.position - dist_vals[i]) / peak.width;
 
-              graph->AddPoint(dist_vals[i], peak.magnitude * std::exp(-pow<2>(offset)));
+              l.points.emplace_back(dist_vals[i], peak.magnitude * std::exp(-pow<2>(offset)));
             }
-
-            mgraph.Add(graph.release());
           }
 
           // graph marking centers of underlying gaussians (some with annotation labels)
@@ -834,53 +1071,27 @@ auto fit()
           {
             const peak_t& peak = peaks[i];
 
-            auto graph{std::make_unique<TGraph>()};
-
-            graph->SetLineColor(kBlack);
-            graph->SetLineWidth(4);
-
-            graph->AddPoint(peak.position, 0);
-            graph->AddPoint(peak.position, peak.magnitude);
+            p.lines.emplace_back(std::vector<std::pair<double, double>>{{peak.position, 0}, {peak.position, peak.magnitude}}, black, 4);
 
             for (auto annotation : annotations)
-            {
               if (annotation.first == i)
-              {
-                auto latex = std::make_unique<TLatex>(graph->GetX()[1], graph->GetY()[1], annotation.second.c_str());
-                graph->GetListOfFunctions()->Add(latex.release());
-              }
-            }
-
-            mgraph.Add(graph.release());
+                p.labels.emplace_back(peak.position, peak.magnitude, annotation.second);
           }
 
-          //mgraph.SetTitle(std::string(cols[n].first).data());
-          //mgraph.SetName (std::string(cols[n].first).data());
-
-          mgraph.Draw("a");
-
-          canvas->SaveAs(fmt::format("cache/graph_{}.bmp", name).c_str());
-        }
-
-        if (std::system(fmt::format("convert cache/graph_{}.bmp cache/graph_{}.png", name, name).c_str()))
-        {
-          fmt::print(fmt::emphasis::bold | fg(fmt::color::red), "Conversion from bmp to png failed\n");
-
-          std::exit(1);
-        }
-
-        if (std::system(fmt::format("rm cache/graph_{}.bmp", name).c_str()))
-        {
-          fmt::print(fmt::emphasis::bold | fg(fmt::color::red), "Deletion of bmp file failed\n");
-
-          std::exit(1);
+          plots.submit(std::move(p));
         }
 
         fmt::print("finished with variable {} ({}/{})\n\n", cols[n].first, n + 1, cols.size());
       }
 
+      // help with the variables still being fitted, until all are done
+      sharing.done();
+
       //if (thread_no == 0)
       sync_point.arrive_and_wait();
+
+      if (finished)
+        return;
       //else
       //{
       //sync_point.arrive_and_drop();
@@ -899,8 +1110,82 @@ auto fit()
   }
 }
 
-int main()
+int main(int argc, char* argv[])
 {
-  fit();
-}
+  acceptance_policy policy{};
+
+  bool resume{false};
+
+  std::size_t chain_count{1};
+
+  // comma separated list of names
+  auto split = [](const std::string_view list)
+  {
+    std::vector<std::string> out{};
+
+    for (std::size_t from = 0; from <= list.size();)
+    {
+      const std::size_t to = std::min(list.find(',', from), list.size());
+
+      if (to > from)
+        out.emplace_back(list.substr(from, to - from));
+
+      from = to + 1;
+    }
+
+    return out;
+  };
+
+  for (int i = 1; i < argc; ++i)
+  {
+    const std::string_view arg{argv[i]};
+
+    bool valid{true};
+
+    if (arg == "--auto")
+      policy.automatic = true;
+    else if (arg == "--resume")
+      resume = true;
+    else if (arg == "--chains" && i + 1 < argc)
+    {
+      const std::string_view val{argv[++i]};
 
+      valid = std::from_chars(val.data(), val.data() + val.size(), chain_count).ec == std::errc{} && chain_count > 0;
+    }
+    else if (arg == "--min-score" && i + 1 < argc)
+    {
+      const std::string_view val{argv[++i]};
+
+      valid = std::from_chars(val.data(), val.data() + val.size(), policy.min_score).ec == std::errc{};
+    }
+    else if (arg == "--max-iterations" && i + 1 < argc)
+    {
+      const std::string_view val{argv[++i]};
+
+      valid = std::from_chars(val.data(), val.data() + val.size(), policy.max_iterations).ec == std::errc{} && policy.max_iterations > 0;
+    }
+    else if (arg == "--allow" && i + 1 < argc)
+      policy.allow = split(argv[++i]);
+    else if (arg == "--deny" && i + 1 < argc)
+      policy.deny = split(argv[++i]);
+    else
+      valid = false;
+
+    if (!valid)
+    {
+      fmt::print("usage: {} [--auto] [--min-score S] [--max-iterations N] [--allow P,...] [--deny P,...] [--resume] [--chains N]\n\n", argv[0]);
+      fmt::print("  --auto to accept the best permitted candidate decay each iteration without asking\n");
+      fmt::print("  --min-score S to reject candidates scoring below S\n");
+      fmt::print("  --max-iterations N to finish after N rounds of fitting\n");
+      fmt::print("  --allow P,... to only accept decays to the listed particles\n");
+      fmt::print("  --deny P,... to never accept decays to the listed particles\n");
+      fmt::print("  --resume to continue from the checkpoint written after the last iteration (cache/fit2_checkpoint.bin)\n");
+      fmt::print("  --chains N to fit each variable with N independently seeded chains, keeping the best (spreads in cache/stability.txt)\n\n");
+      fmt::print("  fitting finishes when no candidate is accepted; every decision is recorded in cache/decisions.txt\n");
+
+      return EXIT_FAILURE;
+    }
+  }
+
+  fit(policy, resume, chain_count);
+}
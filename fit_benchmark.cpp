@@ -0,0 +1,407 @@
+#include "fitting.hpp"
+#include "random_search.hpp"
+#include "levenberg_marquardt.hpp"
+#include "chain_search.hpp"
+#include "em.hpp"
+#include "histogram.hpp"
+#include "kde.hpp"
+
+#include <fmt/format.h>
+#include <fmt/color.h>
+
+#include <vector>
+#include <array>
+#include <random>
+#include <chrono>
+#include <fstream>
+#include <string>
+#include <string_view>
+#include <charconv>
+#include <numbers>
+#include <algorithm>
+
+
+// Benchmark of the gaussian mixture fitters on synthetic mass spectra with known peaks
+//
+// Each spectrum has peak_count gaussian peaks (uniform positions, log-uniform widths, random shares of the signal) on a
+// background that is half flat and half falling exponentially. The events are turned into a density as fit.cpp and
+// fit2.cpp do, and each engine is timed fitting it. Fitted peaks are matched to the true peaks nearest them, and the fit
+// is compared to the counts in each bucket by chi^2. Results are printed and recorded in cache/fit_benchmark.txt.
+
+
+constexpr std::size_t bucket_count{1000};
+
+constexpr std::size_t fine_bucket_count{16384};
+
+constexpr double spread{2.0}; // densities are scaled to match histograms in which each event bled this many buckets either side (linearly)
+
+constexpr double mass_min{0};
+constexpr double mass_max{5000};
+
+constexpr double signal_fraction{0.3};
+
+constexpr std::size_t chain_rounds{20}; // chain searches run one after another, each from the last's peaks (as over fit2's iterations)
+
+
+struct true_peak
+{
+  double mass;
+  double sigma;
+  double events;
+};
+
+
+struct spectrum
+{
+  std::vector<true_peak> peaks;
+  std::vector<double>    values;
+};
+
+
+spectrum generate(const std::size_t event_count, const std::size_t peak_count, std::mt19937_64& prng)
+{
+  auto uniform = [&](const double low, const double high){ return std::uniform_real_distribution(low, high)(prng); };
+
+  spectrum out{};
+
+  const double signal_events = signal_fraction * static_cast<double>(event_count);
+
+  // shares of the signal
+  std::vector<double> shares(peak_count);
+
+  for (double& share : shares)
+    share = std::exponential_distribution(1.0)(prng);
+
+  double share_total{0};
+
+  for (const double share : shares)
+    share_total += share;
+
+  for (const double share : shares)
+    out.peaks.emplace_back(uniform(mass_min + 500, mass_max - 500), std::exp(uniform(std::log(2.0), std::log(60.0))), signal_events * share / share_total);
+
+  out.values.reserve(event_count);
+
+  for (const true_peak& peak : out.peaks)
+  {
+    std::normal_distribution<double> mass{peak.mass, peak.sigma};
+
+    for (auto i = static_cast<std::size_t>(std::lround(peak.events)); i--;)
+      out.values.push_back(mass(prng));
+  }
+
+  std::exponential_distribution<double> falling{1.0 / 1500.0};
+
+  while (out.values.size() < event_count)
+  {
+    if (out.values.size() % 2)
+      out.values.push_back(uniform(mass_min, mass_max));
+    else if (const double mass = mass_min + falling(prng); mass < mass_max)
+      out.values.push_back(mass);
+  }
+
+  std::ranges::shuffle(out.values, prng);
+
+  return out;
+}
+
+
+// how well a fit recovers the true peaks
+struct recovery
+{
+  std::size_t matched{0};
+  std::size_t spurious{0};
+  double      position_error{0}; // mean |fitted - true| / true sigma, over matched peaks
+  double      width_error{0};    // mean |fitted / true - 1|
+  double      yield_error{0};    // mean |fitted / true - 1|
+};
+
+
+// match each true peak (largest first) to the nearest unmatched fitted peak within two true sigma (or two buckets)
+recovery assess(const std::span<const true_peak> truth, const std::span<const peak_t> fitted, const grid_t& grid)
+{
+  recovery out{};
+
+  std::vector<true_peak> sorted{truth.begin(), truth.end()};
+
+  std::ranges::sort(sorted, std::ranges::greater{}, &true_peak::events);
+
+  std::vector<bool> used(fitted.size(), false);
+
+  for (const true_peak& peak : sorted)
+  {
+    const double reach = std::max(2 * peak.sigma, 2 * grid.step);
+
+    std::size_t best = fitted.size();
+
+    for (std::size_t j = 0; j < fitted.size(); ++j)
+      if (!used[j] && std::abs(fitted[j].position - peak.mass) < reach && (best == fitted.size() || std::abs(fitted[j].position - peak.mass) < std::abs(fitted[best].position - peak.mass)))
+        best = j;
+
+    if (best == fitted.size())
+      continue;
+
+    used[best] = true;
+
+    const peak_t& fit = fitted[best];
+
+    // events under the fitted peak (the density is scaled by spread^2 per event per bucket)
+    const double yield = fit.magnitude * fit.width * std::sqrt(std::numbers::pi) / (grid.step * pow<2>(spread));
+
+    ++out.matched;
+
+    out.position_error += std::abs(fit.position - peak.mass) / peak.sigma;
+    out.width_error    += std::abs(fit.width / (peak.sigma * std::numbers::sqrt2) - 1);
+    out.yield_error    += std::abs(yield / peak.events - 1);
+  }
+
+  out.spurious = static_cast<std::size_t>(std::ranges::count(used, false));
+
+  if (out.matched > 0)
+  {
+    out.position_error /= static_cast<double>(out.matched);
+    out.width_error    /= static_cast<double>(out.matched);
+    out.yield_error    /= static_cast<double>(out.matched);
+  }
+
+  return out;
+}
+
+
+// chi^2 per degree of freedom of the fitted peaks (on any background fitted separately) against the events counted in each bucket
+template<std::size_t N>
+double reduced_chi_squared(const std::array<double, N>& counts, const grid_t& grid, const std::span<const peak_t> peaks, const std::array<double, N>& background)
+{
+  std::array<double, N> model{background};
+
+  for (const peak_t& peak : peaks)
+    add_peak(model, grid, peak);
+
+  double chi_squared{0};
+
+  for (std::size_t i = 0; i < N; ++i)
+    chi_squared += pow<2>(model[i] / pow<2>(spread) - counts[i]) / std::max(counts[i], 1.0);
+
+  const double degrees_of_freedom = std::max(1.0, static_cast<double>(N) - 3.0 * static_cast<double>(peaks.size()));
+
+  return chi_squared / degrees_of_freedom;
+}
+
+
+void benchmark(const std::span<const std::size_t> event_counts, const std::span<const std::size_t> peak_counts, const std::span<const std::string> engines, const bool triangular, const std::uint64_t seed)
+{
+  std::ofstream log{"cache/fit_benchmark.txt"};
+
+  auto report = [&](const std::string& line)
+  {
+    fmt::print("{}", line);
+
+    log << line;
+    log.flush();
+  };
+
+  report(fmt::format("{:>9} {:>6} {:<20} {:>10} {:>12} {:>8} {:>9} {:>9} {:>9} {:>9} {:>10}\n",
+                     "events", "peaks", "engine", "time (s)", "evaluations", "found", "spurious", "pos err", "width err", "yield err", "chi2/ndf"));
+
+  auto enabled = [&](const std::string_view engine){ return std::ranges::find(engines, engine) != engines.end(); };
+
+  for (const std::size_t event_count : event_counts)
+    for (const std::size_t peak_count : peak_counts)
+    {
+      std::seed_seq spectrum_seed{seed, std::uint64_t{event_count}, std::uint64_t{peak_count}};
+
+      std::mt19937_64 prng{spectrum_seed};
+
+      const spectrum s = generate(event_count, peak_count, prng);
+
+      // density as the fitters build it
+      const auto fine = make_histogram<fine_bucket_count, double>(s.values, {}, 1.0);
+
+      const grid_t grid = grid_t::spanning(fine.grid.min, fine.grid[fine_bucket_count - 1], bucket_count);
+
+      const auto distribution = [&]
+      {
+        if (triangular)
+          return build_histogram<bucket_count, double>(s.values, {}, grid, spread);
+
+        auto out = kernel_density<bucket_count>(fine.values, fine.grid, grid, {.bandwidth = grid.step});
+
+        for (double& d : out)
+          d *= pow<2>(spread);
+
+        return out;
+      }();
+
+      const auto counts = build_histogram<bucket_count, double>(s.values, {}, grid, 1.0);
+
+      double distribution_total{0};
+
+      for (const double d : distribution)
+        distribution_total += d;
+
+      // background fitted separately from the peaks (only by em), at the scale of the distribution
+      std::array<double, bucket_count> background{};
+
+      auto run = [&](const std::string_view engine, auto engine_func)
+      {
+        if (!enabled(engine))
+          return;
+
+        background.fill(0);
+
+        const auto start = std::chrono::steady_clock::now();
+
+        const fit_result result = engine_func();
+
+        const std::chrono::duration<double> time = std::chrono::steady_clock::now() - start;
+
+        const recovery r = assess(s.peaks, result.peaks, grid);
+
+        report(fmt::format("{:>9} {:>6} {:<20} {:>10.3f} {:>12} {:>5}/{:<2} {:>9} {:>9.3f} {:>9.3f} {:>9.3f} {:>10.3f}\n",
+                           event_count, peak_count, engine, time.count(), result.evaluations, r.matched, peak_count, r.spurious,
+                           r.position_error, r.width_error, r.yield_error, reduced_chi_squared(counts, grid, result.peaks, background)));
+      };
+
+      run("random", [&]{ return fit_random_search(distribution, grid); });
+
+      run("lm", [&]{ return fit_levenberg_marquardt(distribution, grid); });
+
+      // as fit2 fits: chain searches, each continuing from the peaks of the last
+      run("chain", [&]
+      {
+        fit_result out{{}, 0, 0};
+
+        for (std::size_t round = 0; round < chain_rounds; ++round)
+        {
+          std::seed_seq round_seed{seed, std::uint64_t{round}};
+
+          const fit_result next = fit_chain_search(distribution, grid, out.peaks, std::mt19937_64{round_seed});
+
+          out = {next.peaks, next.fit, out.evaluations + next.evaluations};
+        }
+
+        return out;
+      });
+
+      // as fit2 refits a variable before reweighting: levenberg-marquardt peaks, refined unbinned by em (em passes over
+      // the events are counted as evaluations)
+      run("lm+em", [&]
+      {
+        fit_result out = fit_levenberg_marquardt(distribution, grid);
+
+        const std::vector<double> weights(s.values.size(), 1.0);
+
+        const em_result em = fit_em<double>(s.values, weights, seed_components(out.peaks, grid.step, distribution_total));
+
+        for (std::size_t j = 0; j < out.peaks.size(); ++j)
+          out.peaks[j] = em.to_peak(j, grid.step, distribution_total);
+
+        for (std::size_t i = 0; i < bucket_count; ++i)
+          background[i] = em.background_density(grid[i]) * distribution_total * grid.step;
+
+        std::array<double, bucket_count> residuals{};
+
+        levenberg_marquardt::evaluate_residuals(residuals, distribution, grid, out.peaks);
+
+        out.fit = 0;
+
+        for (std::size_t i = 0; i < bucket_count; ++i)
+          out.fit += pow<2>(residuals[i] + background[i]);
+
+        out.evaluations += em.iterations;
+
+        return out;
+      });
+    }
+}
+
+
+int main(int argc, char* argv[])
+{
+  std::vector<std::size_t> event_counts{100000, 1000000};
+  std::vector<std::size_t> peak_counts{3, 10, 30};
+  std::vector<std::string> engines{"random", "lm", "chain", "lm+em"};
+
+  bool triangular{false};
+
+  std::uint64_t seed{1};
+
+  // comma separated list of names
+  auto split = [](const std::string_view list)
+  {
+    std::vector<std::string> out{};
+
+    for (std::size_t from = 0; from <= list.size();)
+    {
+      const std::size_t to = std::min(list.find(',', from), list.size());
+
+      if (to > from)
+        out.emplace_back(list.substr(from, to - from));
+
+      from = to + 1;
+    }
+
+    return out;
+  };
+
+  // comma separated list of positive numbers (empty if any is invalid)
+  auto split_numbers = [&](const std::string_view list)
+  {
+    std::vector<std::size_t> out{};
+
+    for (const std::string& item : split(list))
+    {
+      std::size_t val{};
+
+      if (std::from_chars(item.data(), item.data() + item.size(), val).ec != std::errc{} || val == 0)
+        return std::vector<std::size_t>{};
+
+      out.push_back(val);
+    }
+
+    return out;
+  };
+
+  for (int i = 1; i < argc; ++i)
+  {
+    const std::string_view arg{argv[i]};
+
+    bool valid{true};
+
+    if (arg == "--events" && i + 1 < argc)
+      valid = !(event_counts = split_numbers(argv[++i])).empty();
+    else if (arg == "--peaks" && i + 1 < argc)
+      valid = !(peak_counts = split_numbers(argv[++i])).empty();
+    else if (arg == "--engines" && i + 1 < argc)
+    {
+      engines = split(argv[++i]);
+
+      valid = !engines.empty() && std::ranges::all_of(engines, [](const std::string& e){ return e == "random" || e == "lm" || e == "chain" || e == "lm+em"; });
+    }
+    else if (arg == "--triangular")
+      triangular = true;
+    else if (arg == "--seed" && i + 1 < argc)
+    {
+      const std::string_view val{argv[++i]};
+
+      valid = std::from_chars(val.data(), val.data() + val.size(), seed).ec == std::errc{};
+    }
+    else
+      valid = false;
+
+    if (!valid)
+    {
+      fmt::print("usage: {} [--events N,...] [--peaks N,...] [--engines E,...] [--triangular] [--seed S]\n\n", argv[0]);
+      fmt::print("  --events N,... to generate spectra of each number of events (default 100000,1000000)\n");
+      fmt::print("  --peaks N,... to generate spectra with each number of peaks (default 3,10,30)\n");
+      fmt::print("  --engines E,... to run only the listed engines, of random, lm, chain (as fit2) and lm+em (default all)\n");
+      fmt::print("  --triangular to fit the spread 2 triangular histograms used before kernel density estimation\n");
+      fmt::print("  --seed S to generate different spectra\n\n");
+      fmt::print("  results are recorded in cache/fit_benchmark.txt\n");
+
+      return EXIT_FAILURE;
+    }
+  }
+
+  benchmark(event_counts, peak_counts, engines, triangular, seed);
+}
@@ -0,0 +1,452 @@
+#pragma once
+
+#include <fmt/format.h>
+#include <fmt/compile.h>
+
+#include <array>
+#include <vector>
+#include <span>
+#include <bit>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <random>
+#include <utility>
+#include <algorithm>
+#include <type_traits>
+
+
+// Provides the peak type and the kernels shared by the gaussian mixture fitters (fit.cpp and fit2.cpp)
+//
+// A peak contributes magnitude * exp(-((x - position) / width)^2) at x. Beyond support_widths widths from its position
+// this is below 1e-10 of its magnitude, so it is treated as zero there: evaluating a peak on a histogram only touches
+// the buckets near it. Evaluation is done support-range at a time in simd vectors, using fast_exp.
+
+
+// x to the power of non-negative integer P
+template<std::size_t P>
+[[nodiscard]] constexpr auto pow(auto x) -> decltype(x)
+{
+  if constexpr (P == 0)
+    return 1;
+  else if constexpr (P % 2 == 0)
+    return pow<P/2>(x) * pow<P/2>(x);
+  else
+    return x * pow<P/2>(x) * pow<P/2>(x);
+}
+
+
+
+struct peak_t
+{
+  double position;
+  double magnitude;
+  double width;
+};
+
+
+template <>
+struct fmt::formatter<peak_t>
+{
+  constexpr auto parse(format_parse_context& ctx)
+  {
+    return ctx.end();
+  }
+
+  template<class FormatContext>
+  auto format(const peak_t& p, FormatContext& ctx)
+  {
+    return fmt::format_to(ctx.out(), FMT_COMPILE("p:{} m:{} w:{}"), p.position, p.magnitude, p.width);
+  }
+};
+
+
+// The outcome of fitting peaks to a histogram
+struct fit_result
+{
+  std::vector<peak_t> peaks;
+  double              fit;         // sum over buckets of (model - distribution)^2
+  std::size_t         evaluations; // passes of the model (or its derivatives) over the histogram
+};
+
+
+// how many widths from its position a peak is evaluated
+constexpr double support_widths{5.0};
+
+
+// calls func(i) for each i in [0, count), in order
+// (fitters run their independent pieces of work through such a loop, which callers may replace with one sharing them out)
+struct serial_loop
+{
+  void operator()(const std::size_t count, const auto& func) const
+  {
+    for (std::size_t i = 0; i < count; ++i)
+      func(i);
+  }
+};
+
+
+// The values represented by the buckets of a histogram: size values evenly spaced from min, step apart
+struct grid_t
+{
+  double      min;
+  double      step;
+  std::size_t size;
+
+  // grid of size values from min to max (inclusive)
+  static constexpr grid_t spanning(const double min, const double max, const std::size_t size) noexcept
+  {
+    return {min, (max - min) / static_cast<double>(size - 1), size};
+  }
+
+  constexpr double operator[](const std::size_t i) const noexcept
+  {
+    return min + static_cast<double>(i) * step;
+  }
+
+  // range [first, second) of bucket indexes within support_widths widths of the peak (empty for degenerate peaks)
+  constexpr std::pair<std::size_t, std::size_t> support(const peak_t& peak) const noexcept
+  {
+    if (!(peak.width > 0) || peak.magnitude == 0 || !std::isfinite(peak.position))
+      return {0, 0};
+
+    const double reach = support_widths * peak.width;
+
+    const double from = std::clamp(std::ceil ((peak.position - reach - min) / step),       0.0, static_cast<double>(size));
+    const double to   = std::clamp(std::floor((peak.position + reach - min) / step) + 1.0, 0.0, static_cast<double>(size));
+
+    if (!(from < to)) // also catches nans
+      return {0, 0};
+
+    return {static_cast<std::size_t>(from), static_cast<std::size_t>(to)};
+  }
+};
+
+
+namespace simd
+{
+#if defined(__AVX512F__)
+constexpr std::size_t width{8};
+#elif defined(__AVX__)
+constexpr std::size_t width{4};
+#else
+constexpr std::size_t width{2};
+#endif
+
+// gcc vector extension types (arithmetic and comparisons act lanewise, and scalars are broadcast)
+using doubles = double       __attribute__((vector_size(width * sizeof(double))));
+using int64s  = std::int64_t __attribute__((vector_size(width * sizeof(double))));
+
+// 0, 1, 2, ...
+inline const doubles lane_indexes = []
+{
+  doubles out;
+
+  for (std::size_t i = 0; i < width; ++i)
+    out[i] = static_cast<double>(i);
+
+  return out;
+}();
+
+inline doubles load(const double* const src) noexcept
+{
+  doubles out;
+
+  std::memcpy(&out, src, sizeof(out));
+
+  return out;
+}
+
+// width consecutive floats, converted to double
+inline doubles load(const float* const src) noexcept
+{
+  using floats = float __attribute__((vector_size(width * sizeof(float))));
+
+  floats out;
+
+  std::memcpy(&out, src, sizeof(out));
+
+  return __builtin_convertvector(out, doubles);
+}
+
+inline void store(double* const dest, const doubles val) noexcept
+{
+  std::memcpy(dest, &val, sizeof(val));
+}
+
+// converted to float
+inline void store(float* const dest, const doubles val) noexcept
+{
+  using floats = float __attribute__((vector_size(width * sizeof(float))));
+
+  const floats out = __builtin_convertvector(val, floats);
+
+  std::memcpy(dest, &out, sizeof(out));
+}
+
+inline double sum(const doubles val) noexcept
+{
+  double out{0};
+
+  for (std::size_t i = 0; i < width; ++i)
+    out += val[i];
+
+  return out;
+}
+
+// lanewise square root (the loop compiles to a single vector instruction)
+inline doubles sqrt(const doubles val) noexcept
+{
+  doubles out;
+
+  for (std::size_t i = 0; i < width; ++i)
+    out[i] = std::sqrt(val[i]);
+
+  return out;
+}
+} // namespace simd
+
+
+// exp(x) with relative error below 1e-14, for either doubles or simd::doubles (lanewise)
+// flushes to 0 below x = -708 (rather than producing subnormals); x must not exceed 709
+template<class T>
+[[nodiscard]] inline T fast_exp(const T x) noexcept
+{
+  using I = std::conditional_t<std::is_same_v<T, double>, std::int64_t, simd::int64s>;
+
+  constexpr double log2e  {1.4426950408889634074};
+  constexpr double ln2_hi {6.93147180369123816490e-01};
+  constexpr double ln2_lo {1.90821492927058770002e-10};
+  constexpr double shifter{0x1.8p52}; // adding this rounds to an integer held in the low mantissa bits
+
+  const T t = x * log2e + shifter;
+  const T n = t - shifter;
+
+  // x = n ln2 + r, with |r| <= ln2 / 2
+  const T r = (x - n * ln2_hi) - n * ln2_lo;
+
+  // taylor series of exp(r) to the r^11 term (truncation error below 1e-14 on this range)
+  T p = r * (1.0 / 39916800.0) + (1.0 / 3628800.0);
+  p = p * r + (1.0 / 362880.0);
+  p = p * r + (1.0 / 40320.0);
+  p = p * r + (1.0 / 5040.0);
+  p = p * r + (1.0 / 720.0);
+  p = p * r + (1.0 / 120.0);
+  p = p * r + (1.0 / 24.0);
+  p = p * r + (1.0 / 6.0);
+  p = p * r + 0.5;
+  p = p * r + 1.0;
+  p = p * r + 1.0;
+
+  // 2^n, by placing n + 1023 into the exponent bits
+  const I exponent = (std::bit_cast<I>(t) - std::bit_cast<std::int64_t>(shifter) + 1023) << 52;
+
+  const T out = p * std::bit_cast<T>(exponent);
+
+  if constexpr (std::is_same_v<T, double>)
+    return x < -708.0 ? 0.0 : out;
+  else
+    return x < -708.0 ? T{} : out;
+}
+
+
+// value of a peak at x (for doubles or simd::doubles)
+template<class T>
+[[nodiscard]] inline T evaluate_peak(const peak_t& peak, const T x) noexcept
+{
+  const T offset = (x - peak.position) * (1.0 / peak.width);
+
+  return peak.magnitude * fast_exp(-(offset * offset));
+}
+
+
+// call func(i, value) for each bucket index i in the support of peak, where value is the peak's value there
+// func receives batches of simd::width buckets (as a std::size_t and simd::doubles) followed by single buckets (std::size_t and double)
+template<class F>
+inline void for_peak_support(const grid_t& grid, const peak_t& peak, F&& func) noexcept
+{
+  const auto [from, to] = grid.support(peak);
+
+  std::size_t i = from;
+
+  for (; i + simd::width <= to; i += simd::width)
+  {
+    const simd::doubles x = grid.min + (static_cast<double>(i) + simd::lane_indexes) * grid.step;
+
+    func(i, evaluate_peak(peak, x));
+  }
+
+  for (; i < to; ++i)
+    func(i, evaluate_peak(peak, grid[i]));
+}
+
+
+// out[i] += sign * (value of peak at bucket i), over the support of peak
+inline void add_peak(const std::span<double> out, const grid_t& grid, const peak_t& peak, const double sign = 1.0) noexcept
+{
+  for_peak_support(grid, peak, [&](const std::size_t i, const auto val)
+  {
+    if constexpr (std::is_same_v<decltype(val), const double>)
+      out[i] += sign * val;
+    else
+      simd::store(&out[i], simd::load(&out[i]) + sign * val);
+  });
+}
+
+
+// out[i] = sum over peaks of their values at bucket i
+inline void evaluate_mixture(const std::span<double> out, const grid_t& grid, const std::span<const peak_t> peaks) noexcept
+{
+  std::ranges::fill(out, 0.0);
+
+  for (const peak_t& peak : peaks)
+    add_peak(out, grid, peak);
+}
+
+
+inline double sum_of_squares(const std::span<const double> values) noexcept
+{
+  double out{0};
+
+  for (const double v : values)
+    out += v * v;
+
+  return out;
+}
+
+
+// sum over buckets of (value of peak - residuals)^2, given sum_of_squares(residuals)
+// only the support of peak needs visiting: elsewhere each term is just residuals[i]^2
+inline double peak_fit(const std::span<const double> residuals, const double residuals_sum_of_squares, const grid_t& grid, const peak_t& peak) noexcept
+{
+  double fit{residuals_sum_of_squares};
+
+  simd::doubles fits{};
+
+  for_peak_support(grid, peak, [&](const std::size_t i, const auto val)
+  {
+    if constexpr (std::is_same_v<decltype(val), const double>)
+      fit += val * (val - 2.0 * residuals[i]);
+    else
+      fits += val * (val - 2.0 * simd::load(&residuals[i]));
+  });
+
+  return fit + simd::sum(fits);
+}
+
+
+// random walks a width search is made of, and the steps of each
+// (two walks of 250 found and fitted peaks as well as the single walk of 500 they replaced, on fit_benchmark.cpp's
+// spectra; four of 125, with reach fixed at 10%, found 3% fewer true peaks and 7% more spurious ones)
+constexpr std::size_t width_walks{2};
+constexpr std::size_t width_walk_steps{250};
+
+// width of a peak at position with magnitude that best fits residuals, and that fit
+// searched by width_walks random walks, each trying width_walk_steps widths near the best it has found so far (within a
+// factor of 2 at first, narrowing to 10% by the last step, so walks started far off can still make their way)
+// (starting from a random width up to the span of the grid); the walks are run as independent pieces by loop(count, func)
+// (as serial_loop), each drawing from its own generator seeded from seeds, so the result does not depend on which threads run them
+template<class Loop>
+std::pair<double, double> search_width(const std::span<const double> residuals, const double residuals_sum_of_squares, const grid_t& grid, const double position, const double magnitude, const std::array<std::uint64_t, width_walks>& seeds, const Loop& loop)
+{
+  const double span = grid.step * static_cast<double>(residuals.size() - 1);
+
+  std::array<std::pair<double, double>, width_walks> walks; // best width and fit of each
+
+  loop(width_walks, [&](const std::size_t w)
+  {
+    std::mt19937_64 prng{seeds[w]};
+
+    double best_width = std::uniform_real_distribution(2.5, span)(prng);
+    double best_fit   = std::numeric_limits<double>::infinity();
+
+    for (std::size_t step = 0; step < width_walk_steps; ++step)
+    {
+      // log of the furthest factor tried this step
+      const double reach = std::log(2.0) + (std::log(10.0/9.0) - std::log(2.0)) * static_cast<double>(step) / static_cast<double>(width_walk_steps - 1);
+
+      const double width = best_width * std::exp(std::uniform_real_distribution(-reach, reach)(prng));
+
+      const double fit = peak_fit(residuals, residuals_sum_of_squares, grid, {position, magnitude, width});
+
+      if (fit < best_fit)
+      {
+        best_fit   = fit;
+        best_width = width;
+      }
+    }
+
+    walks[w] = {best_width, best_fit};
+  });
+
+  return *std::ranges::min_element(walks, {}, [](const auto& walk){ return walk.second; });
+}
+
+
+// Difference between a distribution and a set of peaks, along with its sum of squares
+// Kept up to date incrementally as peaks change, so each change costs O(support of the peak) rather than O(buckets x peaks)
+template<std::size_t N>
+struct residuals_t
+{
+  std::array<double, N> values;
+  double                sum_of_squares;
+
+  residuals_t(const std::array<double, N>& distribution, const grid_t& grid, const std::span<const peak_t> peaks) noexcept
+  {
+    recompute(distribution, grid, peaks);
+  }
+
+  // rebuild from scratch (discarding any rounding errors accumulated by incremental updates)
+  void recompute(const std::array<double, N>& distribution, const grid_t& grid, const std::span<const peak_t> peaks) noexcept
+  {
+    values = distribution;
+
+    for (const peak_t& peak : peaks)
+      add_peak(values, grid, peak, -1.0);
+
+    sum_of_squares = ::sum_of_squares(values);
+  }
+
+  // account for a peak added to the set
+  void include(const grid_t& grid, const peak_t& peak) noexcept
+  {
+    change(grid, peak, -1.0);
+  }
+
+  // account for a peak removed from the set
+  void exclude(const grid_t& grid, const peak_t& peak) noexcept
+  {
+    change(grid, peak, 1.0);
+  }
+
+private:
+
+  void change(const grid_t& grid, const peak_t& peak, const double sign) noexcept
+  {
+    simd::doubles change_in_squares{};
+
+    for_peak_support(grid, peak, [&](const std::size_t i, const auto val)
+    {
+      if constexpr (std::is_same_v<decltype(val), const double>)
+      {
+        const double updated = values[i] + sign * val;
+
+        sum_of_squares += (updated - values[i]) * (updated + values[i]);
+
+        values[i] = updated;
+      }
+      else
+      {
+        const simd::doubles old     = simd::load(&values[i]);
+        const simd::doubles updated = old + sign * val;
+
+        change_in_squares += (updated - old) * (updated + old);
+
+        simd::store(&values[i], updated);
+      }
+    });
+
+    sum_of_squares += simd::sum(change_in_squares);
+  }
+};
@@ -1,129 +1,145 @@
-#include "particlefromtree.hpp" 
+#include "recombination.hpp"
+#include "root.hpp"
 
+#include "TROOT.h"
 #include "TFile.h" 
 #include "TTree.h"
-#include "ROOT/RDataFrame.hxx"
 
 #include <fmt/format.h>
 #include <fmt/compile.h>
 #include <fmt/color.h>
 
 #include <array>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <span>
+#include <algorithm>
 #include <string_view>
+#include <charconv>
+#include <bit>
+#include <cstdint>
 
-using namespace std::literals;
+using namespace recombination;
 
-constexpr double z_mass  = 0;
-//constexpr double e_mass  = 0.51099895000; //unused
-constexpr double mu_mass = 105.6583755;
-constexpr double pi_mass = 139.57039;
-constexpr double k_mass  = 493.677;
-constexpr double p_mass  = 938.27208816;
-
-constexpr std::array masses{z_mass, mu_mass, pi_mass, k_mass, p_mass};
+// val rounded to the nearest float with the given number of explicit mantissa bits (of 23), with the rest zeroed
+// (as ROOT does for truncated floats: precision the masses do not need, and which compression then all but removes)
+constexpr float truncate_mantissa(const float val, const int mantissa_bits) noexcept
+{
+  if (mantissa_bits >= 23)
+    return val;
 
-constexpr std::array names {"0"sv, "mu"sv, "pi"sv, "k"sv, "p"sv};
+  const int dropped = 23 - mantissa_bits;
 
-static_assert(masses.size() == names.size());
+  const auto bits = std::bit_cast<std::uint32_t>(val);
 
-constexpr std::size_t preds_count{names.size()};
+  // rounding may carry into the exponent, giving the next power of two as it should
+  return std::bit_cast<float>((bits + (std::uint32_t{1} << (dropped - 1))) & ~((std::uint32_t{1} << dropped) - 1));
+}
 
-// runs a function for every possible recombination of daughter particles
-constexpr void for_all_recombinations(auto func)
+int main(int argc, char* argv[])
 {
-  static_assert(std::invocable<decltype(func), std::uint32_t, std::uint32_t, std::uint32_t, std::uint32_t>, "for_all_recombinations must be passed a function which takes 4 std::uint32_t inputs.");
+  bool store_float{false}; // store masses as floats (/F) rather than doubles (/D)
 
-  for (std::uint32_t ap = 0; ap < preds_count; ++ap)
-  for (std::uint32_t bp = 0; bp < preds_count; ++bp)
-  for (std::uint32_t cp = 0; cp < preds_count; ++cp)
-  for (std::uint32_t dp = 0; dp < preds_count; ++dp)
+  int mantissa_bits{23}; // explicit mantissa bits kept of stored floats
+
+  for (int i = 1; i < argc; ++i)
   {
-    // skip if only 1 or 0 particles
+    const std::string_view arg{argv[i]};
+
+    bool valid{true};
+
+    if (arg == "--float")
+      store_float = true;
+    else if (arg == "--mantissa-bits" && i + 1 < argc)
     {
-      int p_count = 0;
-
-      p_count += ap != 0;
-      p_count += bp != 0;
-      p_count += cp != 0;
-      p_count += dp != 0;
-    
-      if (p_count <= 1)
-        continue;
-    }
+      const std::string_view val{argv[++i]};
+
+      valid = std::from_chars(val.data(), val.data() + val.size(), mantissa_bits).ec == std::errc{} && mantissa_bits >= 1 && mantissa_bits <= 23;
 
-    // skip if combined particle would have charge of +-2
-    if (ap == 0 && bp != 0 && cp == 0 && dp != 0)
-      continue;
+      store_float = true;
+    }
+    else
+      valid = false;
 
-    if (ap != 0 && bp == 0 && cp != 0 && dp == 0)
-      continue;
+    if (!valid)
+    {
+      fmt::print("usage: {} [--float] [--mantissa-bits N]\n\n", argv[0]);
+      fmt::print("  --float             store masses in cache/mass.root as floats rather than doubles (halving its size)\n");
+      fmt::print("  --mantissa-bits N   store floats keeping N of their 23 mantissa bits (1 to 23, implies --float)\n");
 
-    func(ap, bp, cp, dp);
+      return EXIT_FAILURE;
+    }
   }
-}
 
-int main()
-{
-  ROOT::EnableImplicitMT();
+  ROOT::EnableImplicitMT(); // compresses the baskets of the output tree in parallel as they are flushed
 
   const auto output_file = std::make_unique<TFile>("cache/mass.root", "RECREATE");
   const auto output_tree = std::make_unique<TTree>("tree", "tree");
 
-  std::array<std::array<std::array<std::array<double, preds_count>, preds_count>, preds_count>, preds_count> vals;
+  // the branches point to one of these, depending on store_float
+  std::array<double, recombination_count> vals;
+  std::array<float,  recombination_count> float_vals;
 
-  for_all_recombinations([&](const std::uint32_t ap, const std::uint32_t bp, const std::uint32_t cp, const std::uint32_t dp)
+  for (std::size_t r = 0; r < recombination_count; ++r)
   {
-    const auto name = fmt::format("{}_{}_{}_{}", names[ap], names[bp], names[cp], names[dp]);
+    const auto name = recombination::name(recombinations[r]);
 
-    output_tree->Branch(name.c_str(), &vals[ap][bp][cp][dp], (name + "/D").c_str());
-  });
+    if (store_float)
+      output_tree->Branch(name.c_str(), &float_vals[r], (name + "/F").c_str());
+    else
+      output_tree->Branch(name.c_str(), &vals[r], (name + "/D").c_str());
+  }
 
   bool propagate_uid{true};
 
   Long64_t uid;
 
-  constexpr std::array infilenames = std::to_array({"../data/Lb2pKmm_mgUp_2016_UID.root",
-                                                    "../data/Lb2pKmm_mgDn_2016_UID.root",
-                                                    "../data/Lb2pKmm_mgUp_2017_UID.root",
-                                                    "../data/Lb2pKmm_mgDn_2017_UID.root",
-                                                    "../data/Lb2pKmm_mgUp_2018_UID.root",
-                                                    "../data/Lb2pKmm_mgDn_2018_UID.root"});
+  // the momenta of the daughters (and the UIDs) of each input file, read in bulk (a column per thread)
+  struct input
+  {
+    daughter_momenta          momenta;
+    std::vector<std::int64_t> uids;
+  };
+
+  std::vector<input> inputs{};
+
+  std::size_t total_entries{0};
 
-  for (std::size_t f = 0; f < infilenames.size(); ++f)
+  for (std::size_t f = 0; f < input_files.size(); ++f)
   {
-    const auto input_file = std::make_unique<TFile>(infilenames[f]);
-    const auto input_tree = std::shared_ptr<TTree>(dynamic_cast<TTree*>(input_file->Get("tree")));
+    const movency::root::file input_file{std::string{input_files[f]}};
 
-    if (input_tree.get() == nullptr)
+    if (!input_file.ok())
     {
-      fmt::print(fmt::emphasis::bold | fg(fmt::color::red), "ERROR: file {} contains no tree called \"tree\"\n", input_file->GetName());
+      fmt::print(fmt::emphasis::bold | fg(fmt::color::red), "ERROR: cannot read input file {}\n", input_files[f]);
 
       return EXIT_FAILURE;
     }
 
-    const auto entry_count = input_tree->GetEntries();
+    input& in = inputs.emplace_back(read_momenta(input_file));
 
-    fmt::print("Using {} entries from tree \"{}\" in file \"{}\"\n", entry_count, input_tree->GetName(), input_file->GetName());
+    const std::size_t entry_count = in.momenta.size();
 
-    input_tree->SetBranchStatus("*", false); // default all branches to not be read
+    total_entries += entry_count;
 
-    const std::array<Particle, 4> particles{{
-      {"h1" , input_tree}, // p
-      {"h2" , input_tree}, // K
-      {"mu1", input_tree}, // mu
-      {"mu2", input_tree}  // mu
-    }};
+    fmt::print("Using {} entries from file \"{}\"\n", entry_count, input_files[f]);
 
     // Propagate UID variable to output file if present in input files
     if (propagate_uid)
     {
-      auto found = std::make_unique<std::uint32_t>();
+      const auto input_names = input_file.get_names();
 
-      input_tree->SetBranchStatus("UID", true, found.get());
-
-      if (*found)
+      if (std::ranges::find(input_names, "UID"sv, [](const auto& n){ return n.first; }) != input_names.end())
       {
-        input_tree->SetBranchAddress("UID", &uid);
+        in.uids = input_file.uncompress<std::int64_t>("UID");
+
+        if (in.uids.size() != entry_count)
+        {
+          fmt::print(fmt::emphasis::bold | fg(fmt::color::red), "ERROR: {} UIDs in input file {}, but {} entries\n", in.uids.size(), input_files[f], entry_count);
+
+          return EXIT_FAILURE;
+        }
 
         if (f == 0)
           output_tree->Branch("UID", &uid, "UID/L");
@@ -134,49 +150,97 @@ int main()
         {
           propagate_uid = false;
 
-          fmt::print(fmt::emphasis::bold | fg(fmt::color::yellow), "WARNING: No UIDs found in first input file {}, so none will be present in output file.\n", input_file->GetName());
+          fmt::print(fmt::emphasis::bold | fg(fmt::color::yellow), "WARNING: No UIDs found in first input file {}, so none will be present in output file.\n", input_files[f]);
         }
         else
         {
-          fmt::print(fmt::emphasis::bold | fg(fmt::color::red), "ERROR: No UIDs found in input file {}, though previous input files did contain UIDs\n", input_file->GetName());
+          fmt::print(fmt::emphasis::bold | fg(fmt::color::red), "ERROR: No UIDs found in input file {}, though previous input files did contain UIDs\n", input_files[f]);
 
           return EXIT_FAILURE;
         }
       }
     }
+  }
 
-    for (std::int64_t i = 0; i < entry_count; ++i)
-    {
-      if (i % 10'000 == 0 && i)
-        fmt::print("Working on entry {}/{} ({}% completed)\n", i, entry_count, static_cast<double>(i) / static_cast<double>(entry_count) * 100.0);
+  // the events of all inputs, in input order, split into chunks whose masses are computed together
+  constexpr std::size_t chunk_size{1024};
+
+  struct chunk
+  {
+    std::size_t input;
+    std::size_t from;
+    std::size_t to;
+  };
 
-      input_tree->GetEntry(i);
+  std::vector<chunk> chunks{};
 
-      const auto hypotheses = [&]
-      {
-        std::array<std::array<ROOT::Math::XYZTVector, preds_count>, 4> out;
+  for (std::size_t f = 0; f < inputs.size(); ++f)
+    for (std::size_t from = 0; from < inputs[f].momenta.size(); from += chunk_size)
+      chunks.emplace_back(f, from, std::min(inputs[f].momenta.size(), from + chunk_size));
+
+  // a batch of chunks (one per thread) is computed on the pool while the previous batch is filled into the tree, in
+  // order, by the filler thread; batches alternate between two buffers, holding the mass of event i of recombination r
+  // of the c'th chunk of a batch at (c * recombination_count + r) * chunk_size + i
+  const std::size_t batch_size{thread_count};
+
+  std::array<std::vector<double>, 2> buffers{};
+
+  for (auto& buffer : buffers)
+    buffer.resize(batch_size * recombination_count * chunk_size);
+
+  std::jthread filler{};
+
+  std::size_t entries_done{0};
+
+  for (std::size_t first = 0; first < chunks.size(); first += batch_size)
+  {
+    const std::size_t last = std::min(chunks.size(), first + batch_size);
 
-        for (std::uint32_t p = 0; p < 4; ++p)
-          for (std::uint32_t m = 0; m < preds_count; ++m)
-            if (m == 0)
-              out[p][m] = ROOT::Math::XYZTVector{};
-            else
-              out[p][m] = particles[p].getHypothesis(masses[m]);
+    std::vector<double>& buffer = buffers[first / batch_size % 2];
 
-        return out;
-      }();
+    loop_threaded([&](const std::size_t c)
+    {
+      const chunk& ch = chunks[first + c];
+
+      compute_masses(inputs[ch.input].momenta, ch.from, ch.to, std::span{buffer}.subspan(c * recombination_count * chunk_size, recombination_count * chunk_size), chunk_size);
+    }, last - first);
+
+    // the tree is only ever filled by one thread at a time, so the previous batch must be finished with first
+    if (filler.joinable())
+      filler.join();
 
-      for_all_recombinations([&](const std::uint32_t ap, const std::uint32_t bp, const std::uint32_t cp, const std::uint32_t dp)
+    fmt::print("Working on entry {}/{} ({}% completed)\n", entries_done, total_entries, static_cast<double>(entries_done) / static_cast<double>(total_entries) * 100.0);
+
+    filler = std::jthread([&, first, last, &batch = buffer]
+    {
+      for (std::size_t c = 0; c < last - first; ++c)
       {
-        vals[ap][bp][cp][dp] = (hypotheses[0][ap] + hypotheses[1][bp] + hypotheses[2][cp] + hypotheses[3][dp]).M();
-      });
+        const chunk& ch = chunks[first + c];
 
-      output_tree->Fill();
-    }
+        for (std::size_t i = ch.from; i < ch.to; ++i)
+        {
+          if (store_float)
+            for (std::size_t r = 0; r < recombination_count; ++r)
+              float_vals[r] = truncate_mantissa(static_cast<float>(batch[(c * recombination_count + r) * chunk_size + i - ch.from]), mantissa_bits);
+          else
+            for (std::size_t r = 0; r < recombination_count; ++r)
+              vals[r] = batch[(c * recombination_count + r) * chunk_size + i - ch.from];
+
+          if (propagate_uid)
+            uid = inputs[ch.input].uids[i];
+
+          output_tree->Fill();
+        }
+      }
+    });
 
-    fmt::print("Finished with input file {}\n\n", input_file->GetName());
+    for (std::size_t c = first; c < last; ++c)
+      entries_done += chunks[c].to - chunks[c].from;
   }
 
+  if (filler.joinable())
+    filler.join();
+
   fmt::print(fg(fmt::color::green), "Created file \"{}\" with {} entries in tree \"{}\"\n", output_file->GetName(), output_tree->GetEntries(), output_tree->GetName());
 
   output_file->cd();
@@ -0,0 +1,307 @@
+#pragma once
+
+#include "fitting.hpp"
+#include "threading.hpp"
+
+#include <vector>
+#include <array>
+#include <span>
+#include <cmath>
+#include <limits>
+#include <atomic>
+#include <algorithm>
+
+
+// Builds the smoothed histograms (kernel density estimates) that the peak fitters start from
+//
+// An event of weight w at fractional bucket position d adds w * max(0, spread - |i - d|) to each bucket i: a triangular
+// kernel reaching spread buckets either side. Events are processed in chunks, with bucket positions and kernel ranges
+// computed simd::width events at a time.
+//
+// With build_mode::parallel the chunks are shared between the threads of the pool, each filling a private histogram (or
+// range), and these are merged at the end. This must not be used from inside the pool, or from several threads at once;
+// callers that are already parallel over variables should use build_mode::serial.
+//
+// The range of the values is found in its own pass before they are binned, as every event's kernel depends on the final
+// grid. Binning into fine histograms over a provisional range and merging would save that pass, but would shift every
+// event to a provisional bucket position. The range pass is a simd min/max costing under a tenth of the binning pass.
+
+
+enum class build_mode {serial, parallel};
+
+
+template<std::size_t N>
+struct histogram_t
+{
+  grid_t                grid;
+  std::array<double, N> values;
+};
+
+
+namespace histogram_setup
+{
+constexpr std::size_t chunk_size{1 << 16};
+
+// number of private histograms (or ranges) to merge
+inline std::size_t partials(const build_mode mode) noexcept
+{
+  return mode == build_mode::parallel ? thread_count : 1;
+}
+
+// call func(partial_index, from, to) over chunks [from, to) of [0, size), with partial_index in [0, partials(mode))
+inline void for_chunks(const std::size_t size, const build_mode mode, auto func)
+{
+  std::atomic<std::size_t> next{0};
+
+  auto work = [&](const std::uint32_t partial_index)
+  {
+    while (true)
+    {
+      const std::size_t from = next.fetch_add(chunk_size, std::memory_order_relaxed);
+
+      if (from >= size)
+        return;
+
+      func(partial_index, from, std::min(size, from + chunk_size));
+    }
+  };
+
+  if (mode == build_mode::parallel)
+    do_threaded(work);
+  else
+    work(0);
+}
+
+// call func(histogram, from, to) over chunks [from, to) of [0, size), and return the sum of the histograms filled
+template<std::size_t N>
+std::array<double, N> accumulate_chunks(const std::size_t size, const build_mode mode, auto func)
+{
+  std::vector<std::array<double, N>> partial_histograms(partials(mode), std::array<double, N>{});
+
+  for_chunks(size, mode, [&](const std::uint32_t partial_index, const std::size_t from, const std::size_t to)
+  {
+    func(partial_histograms[partial_index], from, to);
+  });
+
+  std::array<double, N> out{partial_histograms.front()};
+
+  for (std::size_t p = 1; p < partial_histograms.size(); ++p)
+    for (std::size_t k = 0; k < N; ++k)
+      out[k] += partial_histograms[p][k];
+
+  return out;
+}
+
+// add weight times the kernel around bucket position distance to buckets [first, last) of out
+inline void scatter(const std::span<double> out, const double distance, const std::size_t first, const std::size_t last, const double spread, const double weight) noexcept
+{
+  for (std::size_t k = first; k < last; ++k)
+    out[k] += weight * std::max(0.0, spread - std::abs(static_cast<double>(k) - distance));
+}
+
+// add weight times the kernel around bucket position distance to out, clamped to the histogram
+inline void scatter(const std::span<double> out, const double distance, const double spread, const double weight) noexcept
+{
+  const double first = std::max  (distance - spread, 0.0);
+  const double last  = std::clamp(distance + spread + 1.0, 0.0, static_cast<double>(out.size()));
+
+  scatter(out, distance, static_cast<std::size_t>(first), static_cast<std::size_t>(last), spread, weight);
+}
+} // namespace histogram_setup
+
+
+// smallest and largest of values (which must not be empty)
+template<class T>
+std::pair<double, double> value_range(const std::span<const T> values, const build_mode mode = build_mode::serial)
+{
+  using namespace histogram_setup;
+
+  std::vector<std::pair<double, double>> ranges(partials(mode), {std::numeric_limits<double>::infinity(), -std::numeric_limits<double>::infinity()});
+
+  for_chunks(values.size(), mode, [&](const std::uint32_t partial_index, const std::size_t from, const std::size_t to)
+  {
+    simd::doubles low  = simd::doubles{} + ranges[partial_index].first;
+    simd::doubles high = simd::doubles{} + ranges[partial_index].second;
+
+    std::size_t i = from;
+
+    for (; i + simd::width <= to; i += simd::width)
+    {
+      const simd::doubles x = simd::load(&values[i]);
+
+      low  = x < low  ? x : low;
+      high = x > high ? x : high;
+    }
+
+    for (std::size_t l = 0; l < simd::width; ++l)
+    {
+      ranges[partial_index].first  = std::min(ranges[partial_index].first,  low [l]);
+      ranges[partial_index].second = std::max(ranges[partial_index].second, high[l]);
+    }
+
+    for (; i < to; ++i)
+    {
+      ranges[partial_index].first  = std::min(ranges[partial_index].first,  static_cast<double>(values[i]));
+      ranges[partial_index].second = std::max(ranges[partial_index].second, static_cast<double>(values[i]));
+    }
+  });
+
+  std::pair<double, double> out{ranges.front()};
+
+  for (const auto& [low, high] : ranges)
+  {
+    out.first  = std::min(out.first,  low);
+    out.second = std::max(out.second, high);
+  }
+
+  return out;
+}
+
+
+// histogram of values over grid, with each value weighted by the corresponding weight (or by 1 if weights is empty)
+template<std::size_t N, class T>
+std::array<double, N> build_histogram(const std::span<const T> values, const std::span<const double> weights, const grid_t& grid, const double spread, const build_mode mode = build_mode::serial)
+{
+  using namespace histogram_setup;
+
+  const double scale = 1.0 / grid.step;
+
+  return accumulate_chunks<N>(values.size(), mode, [&](std::array<double, N>& out, const std::size_t from, const std::size_t to)
+  {
+    std::size_t i = from;
+
+    for (; i + simd::width <= to; i += simd::width)
+    {
+      const simd::doubles distance = (simd::load(&values[i]) - grid.min) * scale;
+
+      // kernel range [first, last) of each event, clamped to the histogram (a bucket exactly spread away gets 0)
+      const simd::doubles low  = distance - spread;
+      const simd::doubles high = distance + spread + 1.0;
+
+      const simd::doubles clamped_high = high > static_cast<double>(N) ? simd::doubles{} + static_cast<double>(N) : high;
+
+      const simd::int64s first = __builtin_convertvector(low  < 0.0 ? simd::doubles{} : low, simd::int64s);
+      const simd::int64s last  = __builtin_convertvector(clamped_high < 0.0 ? simd::doubles{} : clamped_high, simd::int64s);
+
+      const simd::doubles weight = weights.empty() ? simd::doubles{} + 1.0 : simd::load(&weights[i]);
+
+      for (std::size_t l = 0; l < simd::width; ++l)
+        scatter(out, distance[l], static_cast<std::size_t>(first[l]), static_cast<std::size_t>(last[l]), spread, weight[l]);
+    }
+
+    for (; i < to; ++i)
+      scatter(out, (static_cast<double>(values[i]) - grid.min) * scale, spread, weights.empty() ? 1.0 : weights[i]);
+  });
+}
+
+
+// histogram of N buckets spanning the range of values (see build_histogram)
+template<std::size_t N, class T>
+histogram_t<N> make_histogram(const std::span<const T> values, const std::span<const double> weights, const double spread, const build_mode mode = build_mode::serial)
+{
+  auto [min, max] = value_range(values, mode);
+
+  if (!(max > min))
+    max = min + 1;
+
+  const grid_t grid = grid_t::spanning(min, max, N);
+
+  return {grid, build_histogram<N>(values, weights, grid, spread, mode)};
+}
+
+
+// A change in the weight of one event
+struct weight_change
+{
+  std::size_t event;
+  double      delta;
+};
+
+
+// A histogram (as make_histogram) that can be kept up to date as event weights change, by visiting only the events whose
+// weights changed
+//
+// Event positions are quantised to a bucket index and a 16 bit fraction of a bucket, and the histogram is built from
+// these quantised positions too, so that updating it agrees with rebuilding it (up to rounding). Positions are not kept:
+// apply recomputes those of the changed events from their values, so a histogram costs only its buckets.
+template<std::size_t N>
+struct incremental_histogram
+{
+  static_assert(N <= 65536, "bucket indexes of an incremental_histogram must fit in 16 bits");
+
+  grid_t                grid;
+  double                spread;
+  std::array<double, N> values;
+
+  template<class T>
+  incremental_histogram(const std::span<const T> event_values, const std::span<const double> weights, const double kernel_spread, const build_mode mode = build_mode::serial)
+    : spread{kernel_spread}
+  {
+    using namespace histogram_setup;
+
+    auto [min, max] = value_range(event_values, mode);
+
+    if (!(max > min))
+      max = min + 1;
+
+    grid = grid_t::spanning(min, max, N);
+
+    const double scale = 1.0 / grid.step;
+
+    values = accumulate_chunks<N>(event_values.size(), mode, [&](std::array<double, N>& out, const std::size_t from, const std::size_t to)
+    {
+      std::size_t i = from;
+
+      // quantise simd::width positions at a time
+      for (; i + simd::width <= to; i += simd::width)
+      {
+        const simd::doubles distance = (simd::load(&event_values[i]) - grid.min) * scale;
+
+        const simd::int64s bucket = __builtin_convertvector(distance, simd::int64s);
+
+        const simd::doubles fraction = (distance - __builtin_convertvector(bucket, simd::doubles)) * 0x1p16;
+
+        const simd::int64s quantised = __builtin_convertvector(fraction + 0.5, simd::int64s);
+
+        for (std::size_t l = 0; l < simd::width; ++l)
+          scatter(out, quantise(bucket[l], quantised[l]), spread, weights.empty() ? 1.0 : weights[i + l]);
+      }
+
+      for (; i < to; ++i)
+        scatter(out, distance(event_values[i]), spread, weights.empty() ? 1.0 : weights[i]);
+    });
+  }
+
+  // quantised bucket position of an event with the given value (as the histogram was built with)
+  template<class T>
+  double distance(const T value) const noexcept
+  {
+    const double unquantised = (static_cast<double>(value) - grid.min) * (1.0 / grid.step);
+
+    const double bucket = std::floor(unquantised);
+
+    return quantise(static_cast<std::int64_t>(bucket), static_cast<std::int64_t>((unquantised - bucket) * 0x1p16 + 0.5));
+  }
+
+  // account for events whose weights have changed by the given amounts, given the values of events from first_event on
+  template<class T>
+  void apply(const std::span<const weight_change> changes, const std::span<const T> event_values, const std::size_t first_event = 0) noexcept
+  {
+    for (const weight_change& change : changes)
+      histogram_setup::scatter(values, distance(event_values[change.event - first_event]), spread, change.delta);
+  }
+
+private:
+
+  // position from a bucket index and a fraction rounded to units of 2^-16 (which may have rounded up to a whole bucket)
+  static constexpr double quantise(std::int64_t bucket, std::int64_t fraction) noexcept
+  {
+    bucket  += fraction >> 16;
+    fraction = fraction & 0xffff;
+
+    if (bucket >= static_cast<std::int64_t>(N - 1))
+      return static_cast<double>(N - 1);
+
+    return static_cast<double>(std::max(bucket, std::int64_t{0})) + static_cast<double>(fraction) * 0x1p-16;
+  }
+};
@@ -0,0 +1,301 @@
+#pragma once
+
+#include "fitting.hpp"
+
+#include <vector>
+#include <array>
+#include <span>
+#include <complex>
+#include <numbers>
+#include <cmath>
+#include <bit>
+#include <algorithm>
+
+
+// Kernel density estimation by fft convolution
+//
+// Events are first binned finely (linearly, splitting each event's weight between the two nearest fine bins: a
+// histogram with spread 1, as built by histogram.hpp), and the fine bins are then convolved with the chosen kernel in
+// O(B log B) for B fine bins. Bandwidths are standard deviations of the kernel; if none is given, silverman's rule of
+// thumb is used (which over-smooths spectra with sharp peaks on a broad background, so the fitters give their own).
+//
+// With adaptive bandwidth, a fixed bandwidth estimate is used as a pilot, and each fine bin is smoothed with bandwidth
+// proportional to pilot^-1/2 (abramson's square root law): narrower where events are dense, such as in sharp peaks, and
+// wider in sparse tails. Bins are grouped into a few levels of bandwidth, each convolved separately and summed.
+
+
+enum class kde_kernel {gaussian, epanechnikov, triangular};
+
+
+struct kde_options
+{
+  kde_kernel  kernel{kde_kernel::gaussian};
+  double      bandwidth{0};         // in the units of the values (0 for the rule of thumb)
+  double      bandwidth_scale{1.0}; // applied to the bandwidth
+  bool        adaptive{true};
+  std::size_t levels{8};            // bandwidths used when adaptive
+  double      max_adaptation{4.0};  // adaptive bandwidths are kept within this factor of the fixed bandwidth
+};
+
+
+namespace kde
+{
+// in place radix-2 fft (inverse is unnormalised); the size of data must be a power of 2
+inline void fft(std::vector<std::complex<double>>& data, const bool inverse) noexcept
+{
+  const std::size_t n = data.size();
+
+  for (std::size_t i = 1, j = 0; i < n; ++i)
+  {
+    std::size_t bit = n >> 1;
+
+    for (; j & bit; bit >>= 1)
+      j ^= bit;
+
+    j ^= bit;
+
+    if (i < j)
+      std::swap(data[i], data[j]);
+  }
+
+  for (std::size_t length = 2; length <= n; length <<= 1)
+  {
+    const double angle = (inverse ? 2.0 : -2.0) * std::numbers::pi / static_cast<double>(length);
+
+    const std::complex<double> root{std::cos(angle), std::sin(angle)};
+
+    for (std::size_t i = 0; i < n; i += length)
+    {
+      std::complex<double> w{1.0, 0.0};
+
+      for (std::size_t j = 0; j < length / 2; ++j)
+      {
+        const std::complex<double> u = data[i + j];
+        const std::complex<double> v = data[i + j + length / 2] * w;
+
+        data[i + j]              = u + v;
+        data[i + j + length / 2] = u - v;
+
+        w *= root;
+      }
+    }
+  }
+}
+
+
+// rule of thumb bandwidth (in the units of the values) of the weighted distribution held in fine bins
+inline double silverman_bandwidth(const std::span<const double> bins, const grid_t& fine_grid) noexcept
+{
+  double total{0};
+  double mean{0};
+
+  for (std::size_t i = 0; i < bins.size(); ++i)
+  {
+    total += bins[i];
+    mean  += bins[i] * fine_grid[i];
+  }
+
+  if (!(total > 0))
+    return fine_grid.step;
+
+  mean /= total;
+
+  double variance{0};
+
+  for (std::size_t i = 0; i < bins.size(); ++i)
+    variance += bins[i] * pow<2>(fine_grid[i] - mean);
+
+  variance /= total;
+
+  // interquartile range, from the cumulative distribution
+  auto quantile = [&](const double q)
+  {
+    double cumulative{0};
+
+    for (std::size_t i = 0; i < bins.size(); ++i)
+    {
+      cumulative += bins[i];
+
+      if (cumulative >= q * total)
+        return fine_grid[i];
+    }
+
+    return fine_grid[bins.size() - 1];
+  };
+
+  const double iqr = quantile(0.75) - quantile(0.25);
+
+  const double spread = iqr > 0 ? std::min(std::sqrt(variance), iqr / 1.34) : std::sqrt(variance);
+
+  return std::max(fine_grid.step, 0.9 * spread * std::pow(total, -0.2));
+}
+
+
+// kernel with standard deviation 1 at offset x (unnormalised), and the offset beyond which it is (negligibly close to) 0
+inline double kernel_value(const kde_kernel kernel, const double x) noexcept
+{
+  switch (kernel)
+  {
+    case kde_kernel::epanechnikov: return std::max(0.0, 1.0 - pow<2>(x) / 5.0);
+    case kde_kernel::triangular:   return std::max(0.0, 1.0 - std::abs(x) / std::sqrt(6.0));
+    default:                       return fast_exp(-0.5 * pow<2>(x));
+  }
+}
+
+inline double kernel_reach(const kde_kernel kernel) noexcept
+{
+  switch (kernel)
+  {
+    case kde_kernel::epanechnikov: return std::sqrt(5.0);
+    case kde_kernel::triangular:   return std::sqrt(6.0);
+    default:                       return support_widths * std::numbers::sqrt2;
+  }
+}
+
+
+// convolution of bins with the kernel of standard deviation sigma (in bins), using the transform of the padded bins
+inline std::vector<double> convolve(const std::vector<std::complex<double>>& transformed_bins, const std::size_t bin_count, const kde_kernel kernel_type, const double sigma)
+{
+  const std::size_t size = transformed_bins.size();
+
+  // kernel, wrapped around index 0, and normalised to sum to 1
+  std::vector<std::complex<double>> kernel(size);
+
+  const auto reach = std::min(static_cast<std::size_t>(std::ceil(kernel_reach(kernel_type) * sigma)), size / 2 - 1);
+
+  double kernel_total{0};
+
+  for (std::size_t i = 0; i <= reach; ++i)
+  {
+    const double val = kernel_value(kernel_type, static_cast<double>(i) / sigma);
+
+    kernel[i] = val;
+
+    if (i > 0)
+      kernel[size - i] = val;
+
+    kernel_total += i > 0 ? 2 * val : val;
+  }
+
+  fft(kernel, false);
+
+  for (std::size_t i = 0; i < size; ++i)
+    kernel[i] *= transformed_bins[i];
+
+  fft(kernel, true);
+
+  std::vector<double> out(bin_count);
+
+  for (std::size_t i = 0; i < bin_count; ++i)
+    out[i] = std::max(0.0, kernel[i].real() / (static_cast<double>(size) * kernel_total));
+
+  return out;
+}
+
+
+// transform of bins zero padded to at least twice their number (so convolutions do not wrap around)
+inline std::vector<std::complex<double>> transform(const std::span<const double> bins)
+{
+  std::vector<std::complex<double>> out(std::bit_ceil(2 * bins.size()));
+
+  std::ranges::copy(bins, out.begin());
+
+  fft(out, false);
+
+  return out;
+}
+} // namespace kde
+
+
+// density of the events held in fine bins (spanning fine_grid), as weight per bucket of grid (N buckets over the same range)
+// the convolutions of the adaptive bandwidth levels are independent, and are run by loop(count, func) (as serial_loop)
+template<std::size_t N, class Loop = serial_loop>
+std::array<double, N> kernel_density(const std::span<const double> bins, const grid_t& fine_grid, const grid_t& grid, const kde_options& options = {}, const Loop& loop = {})
+{
+  using namespace kde;
+
+  const double bandwidth = options.bandwidth > 0 ? options.bandwidth : silverman_bandwidth(bins, fine_grid);
+
+  const double sigma = std::max(0.5, options.bandwidth_scale * bandwidth / fine_grid.step); // in fine bins
+
+  std::vector<double> fine_density = convolve(transform(bins), bins.size(), options.kernel, sigma);
+
+  if (options.adaptive && options.levels > 1 && std::ranges::any_of(bins, [](const double b){ return b > 0; }))
+  {
+    // pilot density relative to its (weighted) geometric mean, at each fine bin
+    double log_mean{0};
+    double total{0};
+
+    for (std::size_t i = 0; i < bins.size(); ++i)
+      if (bins[i] > 0 && fine_density[i] > 0)
+      {
+        log_mean += bins[i] * std::log(fine_density[i]);
+        total    += bins[i];
+      }
+
+    const double geometric_mean = std::exp(log_mean / total);
+
+    // level of each fine bin, from its bandwidth factor (pilot / geometric mean)^-1/2 on a log scale
+    const double log_max = std::log(options.max_adaptation);
+
+    std::vector<std::size_t> levels(bins.size());
+
+    for (std::size_t i = 0; i < bins.size(); ++i)
+    {
+      const double log_factor = fine_density[i] > 0 ? std::clamp(-0.5 * std::log(fine_density[i] / geometric_mean), -log_max, log_max) : log_max;
+
+      levels[i] = static_cast<std::size_t>(std::lround((log_factor + log_max) / (2 * log_max) * static_cast<double>(options.levels - 1)));
+    }
+
+    std::vector<std::vector<double>> level_densities(options.levels);
+
+    loop(options.levels, [&](const std::size_t level)
+    {
+      std::vector<double> level_bins(bins.size());
+
+      bool used{false};
+
+      for (std::size_t i = 0; i < bins.size(); ++i)
+      {
+        const bool in_level = bins[i] != 0 && levels[i] == level;
+
+        level_bins[i] = in_level ? bins[i] : 0.0;
+
+        used |= in_level;
+      }
+
+      if (!used)
+        return;
+
+      const double log_factor = -log_max + 2 * log_max * static_cast<double>(level) / static_cast<double>(options.levels - 1);
+
+      level_densities[level] = convolve(transform(level_bins), bins.size(), options.kernel, std::max(0.5, sigma * std::exp(log_factor)));
+    });
+
+    std::vector<double> adaptive_density(bins.size());
+
+    for (const std::vector<double>& level_density : level_densities)
+      for (std::size_t i = 0; i < level_density.size(); ++i)
+        adaptive_density[i] += level_density[i];
+
+    fine_density = std::move(adaptive_density);
+  }
+
+  // sample at the buckets of grid (interpolating linearly between fine bins), converting to weight per bucket
+  std::array<double, N> out;
+
+  const double per_bucket = grid.step / fine_grid.step;
+
+  for (std::size_t i = 0; i < N; ++i)
+  {
+    const double position = std::clamp((grid[i] - fine_grid.min) / fine_grid.step, 0.0, static_cast<double>(bins.size() - 1));
+
+    const auto below = std::min(static_cast<std::size_t>(position), bins.size() - 2);
+
+    const double fraction = position - static_cast<double>(below);
+
+    out[i] = per_bucket * ((1 - fraction) * fine_density[below] + fraction * fine_density[below + 1]);
+  }
+
+  return out;
+}
@@ -0,0 +1,298 @@
+#pragma once
+
+#include "fitting.hpp"
+
+#include <vector>
+#include <array>
+#include <span>
+#include <cmath>
+#include <numbers>
+#include <algorithm>
+
+
+// Deterministic gaussian mixture fitting by damped least squares (Levenberg-Marquardt)
+//
+// Peaks are seeded one at a time at the largest residual (as the random searches do), with a width taken from where the
+// residual falls to 1/e of that height. After each seeding all peaks are refined jointly, using the analytic jacobian
+// of each peak over its support. Seeding stops once a new peak no longer improves the fit appreciably.
+
+
+struct lm_options
+{
+  std::size_t max_peaks{40};
+  std::size_t max_iterations{100};       // per joint refinement
+  double      min_improvement{1e-3};     // relative improvement in fit required to keep seeding peaks
+};
+
+
+namespace levenberg_marquardt
+{
+// solve a x = b in place (b becomes x) for symmetric positive definite a (k x k, row major), returning false if a is not positive definite
+inline bool cholesky_solve(std::vector<double>& a, std::vector<double>& b, const std::size_t k) noexcept
+{
+  for (std::size_t j = 0; j < k; ++j)
+  {
+    double d = a[j * k + j];
+
+    for (std::size_t l = 0; l < j; ++l)
+      d -= pow<2>(a[j * k + l]);
+
+    if (!(d > 0))
+      return false;
+
+    d = std::sqrt(d);
+
+    a[j * k + j] = d;
+
+    for (std::size_t i = j + 1; i < k; ++i)
+    {
+      double s = a[i * k + j];
+
+      for (std::size_t l = 0; l < j; ++l)
+        s -= a[i * k + l] * a[j * k + l];
+
+      a[i * k + j] = s / d;
+    }
+  }
+
+  for (std::size_t i = 0; i < k; ++i)
+  {
+    for (std::size_t l = 0; l < i; ++l)
+      b[i] -= a[i * k + l] * b[l];
+
+    b[i] /= a[i * k + i];
+  }
+
+  for (std::size_t i = k; i--;)
+  {
+    for (std::size_t l = i + 1; l < k; ++l)
+      b[i] -= a[l * k + i] * b[l];
+
+    b[i] /= a[i * k + i];
+  }
+
+  return true;
+}
+
+
+// model minus distribution at each bucket, and the sum of its squares
+template<std::size_t N>
+double evaluate_residuals(std::array<double, N>& out, const std::array<double, N>& distribution, const grid_t& grid, const std::span<const peak_t> peaks) noexcept
+{
+  evaluate_mixture(out, grid, peaks);
+
+  double fit{};
+
+  for (std::size_t i = 0; i < N; ++i)
+  {
+    out[i] -= distribution[i];
+
+    fit += pow<2>(out[i]);
+  }
+
+  return fit;
+}
+
+
+// jointly refine peaks to minimise the fit, returning the new fit
+template<std::size_t N>
+double refine(std::vector<peak_t>& peaks, const std::array<double, N>& distribution, const grid_t& grid, const lm_options& options, std::size_t& evaluations)
+{
+  const std::size_t k = 3 * peaks.size();
+
+  std::array<double, N> residuals;
+
+  double fit = evaluate_residuals(residuals, distribution, grid, peaks);
+
+  ++evaluations;
+
+  double damping{1e-3};
+
+  // derivatives of each peak over its support, with respect to (position, magnitude, width)
+  std::vector<std::pair<std::size_t, std::size_t>> supports(peaks.size());
+  std::vector<std::vector<std::array<double, 3>>>   jacobian(peaks.size());
+
+  std::vector<double> a(k * k);
+  std::vector<double> g(k);
+  std::vector<double> m(k * k);
+  std::vector<double> step(k);
+
+  std::vector<peak_t> trial(peaks.size());
+
+  std::array<double, N> trial_residuals;
+
+  for (std::size_t iteration = 0; iteration < options.max_iterations; ++iteration)
+  {
+    for (std::size_t p = 0; p < peaks.size(); ++p)
+    {
+      const peak_t& peak = peaks[p];
+
+      supports[p] = grid.support(peak);
+
+      jacobian[p].resize(supports[p].second - supports[p].first);
+
+      for (std::size_t i = supports[p].first; i < supports[p].second; ++i)
+      {
+        const double u = (grid[i] - peak.position) / peak.width;
+        const double e = fast_exp(-u * u);
+
+        const double d_position = peak.magnitude * e * 2.0 * u / peak.width;
+
+        jacobian[p][i - supports[p].first] = {d_position, e, d_position * u};
+      }
+    }
+
+    ++evaluations;
+
+    // a = J^T J and g = J^T r, visiting only where supports overlap
+    std::ranges::fill(a, 0.0);
+    std::ranges::fill(g, 0.0);
+
+    for (std::size_t p = 0; p < peaks.size(); ++p)
+    {
+      for (std::size_t i = supports[p].first; i < supports[p].second; ++i)
+        for (std::size_t x = 0; x < 3; ++x)
+          g[3 * p + x] += jacobian[p][i - supports[p].first][x] * residuals[i];
+
+      for (std::size_t q = p; q < peaks.size(); ++q)
+      {
+        const std::size_t from = std::max(supports[p].first,  supports[q].first);
+        const std::size_t to   = std::min(supports[p].second, supports[q].second);
+
+        for (std::size_t i = from; i < to; ++i)
+          for (std::size_t x = 0; x < 3; ++x)
+            for (std::size_t y = 0; y < 3; ++y)
+              a[(3 * p + x) * k + 3 * q + y] += jacobian[p][i - supports[p].first][x] * jacobian[q][i - supports[q].first][y];
+      }
+    }
+
+    for (std::size_t r = 0; r < k; ++r)
+      for (std::size_t c = 0; c < r; ++c)
+        a[r * k + c] = a[c * k + r];
+
+    bool improved{false};
+
+    for (auto _ = 12; _--;)
+    {
+      m = a;
+
+      for (std::size_t r = 0; r < k; ++r)
+      {
+        m[r * k + r] += damping * a[r * k + r] + 1e-300;
+
+        step[r] = -g[r];
+      }
+
+      if (!cholesky_solve(m, step, k))
+      {
+        damping *= 10;
+
+        continue;
+      }
+
+      bool valid{true};
+
+      for (std::size_t p = 0; p < peaks.size(); ++p)
+      {
+        trial[p] = {peaks[p].position + step[3 * p], peaks[p].magnitude + step[3 * p + 1], peaks[p].width + step[3 * p + 2]};
+
+        valid &= trial[p].width > 0 && std::isfinite(trial[p].position) && std::isfinite(trial[p].magnitude);
+      }
+
+      if (!valid)
+      {
+        damping *= 10;
+
+        continue;
+      }
+
+      const double trial_fit = evaluate_residuals(trial_residuals, distribution, grid, trial);
+
+      ++evaluations;
+
+      if (trial_fit < fit)
+      {
+        improved = (fit - trial_fit) > 1e-10 * fit;
+
+        fit = trial_fit;
+
+        std::swap(peaks, trial);
+        std::swap(residuals, trial_residuals);
+
+        damping = std::max(damping / 10, 1e-12);
+
+        break;
+      }
+
+      damping *= 10;
+    }
+
+    if (!improved)
+      break;
+  }
+
+  return fit;
+}
+} // namespace levenberg_marquardt
+
+
+template<std::size_t N>
+fit_result fit_levenberg_marquardt(const std::array<double, N>& distribution, const grid_t& grid, const lm_options& options = {})
+{
+  using namespace levenberg_marquardt;
+
+  fit_result out{{}, sum_of_squares(distribution), 0};
+
+  std::array<double, N> residuals{distribution};
+
+  while (out.peaks.size() < options.max_peaks)
+  {
+    const auto max_idx = static_cast<std::size_t>(std::ranges::max_element(residuals) - residuals.begin());
+
+    const double magnitude = residuals[max_idx];
+
+    if (!(magnitude > 0))
+      break;
+
+    // width from where the residual falls below magnitude / e on either side
+    const double width = [&]
+    {
+      std::size_t below = max_idx;
+      std::size_t above = max_idx;
+
+      while (below > 0     && residuals[below - 1] > magnitude / std::numbers::e)
+        --below;
+
+      while (above + 1 < N && residuals[above + 1] > magnitude / std::numbers::e)
+        ++above;
+
+      return std::max(1.0, static_cast<double>(above - below + 1) / 2.0) * grid.step;
+    }();
+
+    auto peaks = out.peaks;
+
+    peaks.emplace_back(grid[max_idx], magnitude, width);
+
+    const double fit = refine(peaks, distribution, grid, options, out.evaluations);
+
+    if (!(fit < out.fit * (1.0 - options.min_improvement)))
+      break;
+
+    // drop peaks the refinement has turned negative or narrower than a bucket
+    std::erase_if(peaks, [&](const peak_t& peak){ return peak.magnitude <= 0 || peak.width < grid.step / 4; });
+
+    if (peaks.size() <= out.peaks.size())
+      break;
+
+    out.peaks = std::move(peaks);
+    out.fit   = evaluate_residuals(residuals, distribution, grid, out.peaks);
+
+    ++out.evaluations;
+
+    // residuals are distribution minus model from here on
+    for (double& r : residuals)
+      r = -r;
+  }
+
+  return out;
+}
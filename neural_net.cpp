@@ -1,5 +1,6 @@
 #include "root.hpp"
 #include "threading.hpp"
+#include "allreduce.hpp"
 
 #include "TCanvas.h"
 #include "TGraph.h"
@@ -23,6 +24,10 @@
 #include <barrier>
 #include <functional>
 
+#include <sched.h>
+#include <signal.h>
+#include <sys/prctl.h>
+
 
 using namespace movency;
 
@@ -427,12 +432,112 @@ void print_connections(const T& connections)
 }
 
 
-int main()
+// fork process_count - 1 further processes, returning the rank of the calling process (0 for the original)
+std::size_t spawn_processes(const std::size_t process_count)
+{
+  for (std::size_t rank = 1; rank < process_count; ++rank)
+  {
+    const pid_t pid = fork();
+
+    if (pid == -1)
+    {
+      fmt::print(fmt::emphasis::bold | fg(fmt::color::red), "ERROR: unable to fork process {}\n", rank);
+
+      std::exit(EXIT_FAILURE);
+    }
+
+    if (pid == 0)
+    {
+      prctl(PR_SET_PDEATHSIG, SIGTERM); // end along with the original process
+
+      return rank;
+    }
+  }
+
+  return 0;
+}
+
+// restrict the calling process to its contiguous share of the cpus it may run on, returning the size of that share
+// (contiguous cpu numbers usually share a NUMA domain, so with one process per domain each stays on its own socket)
+std::size_t pin_to_cpu_share(const std::size_t rank, const std::size_t process_count)
 {
+  cpu_set_t available;
+
+  CPU_ZERO(&available);
+
+  sched_getaffinity(0, sizeof(available), &available);
+
+  std::vector<std::size_t> cpus{};
+
+  for (std::size_t cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+    if (CPU_ISSET(cpu, &available))
+      cpus.push_back(cpu);
+
+  const std::size_t from = cpus.size() *  rank      / process_count;
+  const std::size_t to   = cpus.size() * (rank + 1) / process_count;
+
+  if (from == to)
+    return 1;
+
+  cpu_set_t share;
+
+  CPU_ZERO(&share);
+
+  for (std::size_t i = from; i < to; ++i)
+    CPU_SET(cpus[i], &share);
+
+  sched_setaffinity(0, sizeof(share), &share);
+
+  return to - from;
+}
+
+
+int main(int argc, char* argv[])
+{
+  std::size_t process_count{1};
+
+  bool use_tcp{false};
+
+  for (int i = 1; i < argc; ++i)
+  {
+    const std::string_view arg{argv[i]};
+
+    if (arg == "--processes" && i + 1 < argc)
+    {
+      const std::string_view count{argv[++i]};
+
+      if (std::from_chars(count.data(), count.data() + count.size(), process_count).ec != std::errc{} || process_count == 0)
+        process_count = 0;
+    }
+    else if (arg == "--tcp")
+      use_tcp = true;
+    else
+      process_count = 0;
+
+    if (process_count == 0)
+    {
+      fmt::print("usage: {} [--processes N [--tcp]]\n\n", argv[0]);
+      fmt::print("  --processes N to train with N processes, each owning a shard of the training data and a share of the cpus\n");
+      fmt::print("  --tcp to combine the processes' updates over loopback sockets rather than shared memory\n");
+
+      return EXIT_FAILURE;
+    }
+  }
+
   const auto [data, fraction_background] = create_data();
 
   const auto fraction_signal = 1.0 - fraction_background;
 
+  const std::size_t train_cutoff_index = (data.size() * 9) / 10;
+
+  // each process samples from its own shard of the training events, so none may be left without one
+  if (process_count > train_cutoff_index)
+  {
+    fmt::print(fmt::emphasis::bold | fg(fmt::color::red), "ERROR: {} processes requested but only {} training events available\n", process_count, train_cutoff_index);
+
+    return EXIT_FAILURE;
+  }
+
   constexpr std::size_t depth{5};
 
   [[maybe_unused]] constexpr double dropout{0.5};
@@ -452,9 +557,43 @@ int main()
   bool train{true};
   bool mass_graph{false};
 
+  // created before forking so that every process shares it (and starts from the same data and connections)
+  const auto comm = [&]() -> std::unique_ptr<communicator>
+  {
+    if (process_count == 1)
+      return {};
+
+    if (use_tcp)
+      return std::make_unique<tcp_communicator>(process_count);
+
+    return std::make_unique<shm_communicator>(process_count);
+  }();
+
+  const std::size_t rank = spawn_processes(process_count);
+
+  if (comm)
+    comm->join(rank);
+
+  const std::size_t local_thread_count = process_count == 1 ? thread_count : std::min(thread_count, pin_to_cpu_share(rank, process_count));
+
+  if (process_count > 1)
+    fmt::print("process {}/{} running {} threads\n", rank, process_count, local_thread_count);
+
+  // sum values across all processes
+  auto all_sum = [&](const std::span<double> values)
+  {
+    if (comm)
+      comm->sum(values);
+  };
+
   std::vector<decltype(connections)> updates(thread_count);
 
-  const std::size_t train_cutoff_index = (data.size() * 9) / 10;
+  // the training events this process samples from (copied after pinning, so the copy is local to this process' NUMA domain)
+  const std::vector<std::array<double, variable_count + 1>> shard(data.begin() + static_cast<std::ptrdiff_t>(train_cutoff_index *  rank      / process_count),
+                                                                  data.begin() + static_cast<std::ptrdiff_t>(train_cutoff_index * (rank + 1) / process_count));
+
+  // flattened sum of a round's updates from every thread of every process
+  std::vector<double> gradient((depth - 1) * variable_count * variable_count);
 
   std::vector<double> predictions(data.size());
 
@@ -464,15 +603,34 @@ int main()
 
   auto combine_updates = [&]
   {
+    std::ranges::fill(gradient, 0.0);
+
     for (auto& update : updates)
       for (std::size_t i = 0; i < depth - 1; ++i)
         for (std::size_t j = 0; j < variable_count; ++j)
           for (std::size_t k = 0; k < variable_count; ++k)
-            connections[i][j][k] += update[i][j][k];
+            gradient[(i * variable_count + j) * variable_count + k] += update[i][j][k];
+
+    all_sum(gradient);
+
+    for (std::size_t i = 0; i < depth - 1; ++i)
+      for (std::size_t j = 0; j < variable_count; ++j)
+        for (std::size_t k = 0; k < variable_count; ++k)
+          connections[i][j][k] += gradient[(i * variable_count + j) * variable_count + k];
 
     if (!excess_reps)
     {
-      if (!train)
+      if (!train && comm)
+      {
+        // each process scored an interleaved share of the events; gather them all
+        for (std::size_t i = 0; i < predictions.size(); ++i)
+          if (i % process_count != rank)
+            predictions[i] = 0;
+
+        all_sum(predictions);
+      }
+
+      if (!train && rank == 0)
       {
         if (mass_graph)
         {
@@ -509,7 +667,7 @@ int main()
 
       char input;
 
-      while (true)
+      while (rank == 0)
       {
         fmt::print("input: Print, tEst, Output, tRain, or Info? ");
 
@@ -554,16 +712,31 @@ int main()
 
         break;
       }
+
+      // only the first process takes input, so share its decision
+      std::array control{static_cast<double>(train), static_cast<double>(excess_reps)};
+
+      if (rank != 0)
+        control = {};
+
+      all_sum(control);
+
+      train       = control[0] != 0;
+      excess_reps = static_cast<std::ptrdiff_t>(control[1]);
     }
 
-    reps = std::min(excess_reps, 100l);
+    // a round is up to 100 repetitions per process, shared between the processes
+    const auto round_reps = std::min(excess_reps, 100l * static_cast<std::ptrdiff_t>(process_count));
 
-    excess_reps -= reps;
+    excess_reps -= round_reps;
+
+    reps = round_reps * static_cast<std::ptrdiff_t>(rank + 1) / static_cast<std::ptrdiff_t>(process_count)
+         - round_reps * static_cast<std::ptrdiff_t>(rank    ) / static_cast<std::ptrdiff_t>(process_count);
 
     return;
   };
 
-  std::barrier sync_point(static_cast<std::ptrdiff_t>(thread_count), combine_updates);
+  std::barrier sync_point(static_cast<std::ptrdiff_t>(local_thread_count), combine_updates);
 
   auto iterate = [&](const auto thread_no)
   {
@@ -579,7 +752,7 @@ int main()
         {
           r = reps.fetch_sub(1, std::memory_order_relaxed);
 
-          index = movency::random::fast(movency::random::uniform_distribution(std::size_t{0}, train_cutoff_index - 1));
+          index = movency::random::fast(movency::random::uniform_distribution(std::size_t{0}, shard.size() - 1));
 
           if (r <= 0)
             break;
@@ -588,17 +761,19 @@ int main()
         {
           r = reps.fetch_add(1, std::memory_order_relaxed);
 
-          index = static_cast<std::size_t>(r);
+          index = static_cast<std::size_t>(r) * process_count + rank;
 
           if (index >= data.size())
             break;
         }
 
+        const auto& event = train ? shard[index] : data[index];
+
         std::array<std::array<double, variable_count>, depth> nodes;
 
         for (std::size_t i = 0; i < variable_count; ++i)
         {
-          nodes[0][i] = data[index][i];
+          nodes[0][i] = event[i];
           //fmt::print("*{} ", nodes[0][i]);
         }
         //fmt::print("{}\n\n", data[index][variable_count]);
@@ -628,7 +803,7 @@ int main()
         {
           // begin backpropagation of errors
 
-          const auto target = data[index][variable_count];
+          const auto target = event[variable_count];
 
           const auto bias = target ? fraction_background : fraction_signal;
 
@@ -668,7 +843,7 @@ int main()
     }
   };
 
-  do_threaded_without_pool(iterate);
+  do_threaded_without_pool(iterate, local_thread_count);
 
   fmt::print("done\n");
 
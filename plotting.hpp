@@ -0,0 +1,476 @@
+#pragma once
+
+#include <fmt/format.h>
+#include <fmt/color.h>
+
+#include <zlib/zlib.h>
+
+#include <vector>
+#include <array>
+#include <deque>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <cstdint>
+#include <cmath>
+#include <limits>
+#include <fstream>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <algorithm>
+#include <cstdio>
+
+
+// Renders line plots directly to png files, on dedicated render threads
+//
+// A plot is described by value (lines of points, and text labels at points), and submitted to a plotter, which queues it
+// and returns at once: rendering, compression and writing happen on the plotter's own threads, so submitting never waits
+// for another plot. Axes are scaled to fit the lines, with tick labels, and text uses a built in 5x7 pixel font.
+//
+// The plotter finishes every queued plot before its destructor returns.
+
+
+namespace plotting
+{
+struct colour
+{
+  std::uint8_t r;
+  std::uint8_t g;
+  std::uint8_t b;
+};
+
+constexpr colour white{255, 255, 255};
+constexpr colour black{  0,   0,   0};
+constexpr colour red  {220,   0,   0};
+constexpr colour blue {  0,   0, 220};
+constexpr colour grey {200, 200, 200};
+
+
+struct line
+{
+  std::vector<std::pair<double, double>> points;
+  plotting::colour                       colour;
+  int                                    width; // in pixels
+};
+
+
+struct label
+{
+  double      x;
+  double      y;
+  std::string text;
+};
+
+
+struct plot
+{
+  std::string        path;  // of the png file to write
+  std::string        title;
+  std::vector<line>  lines;
+  std::vector<label> labels;
+  std::size_t        width{1500};
+  std::size_t        height{950};
+  std::string        copy_path{}; // if not empty, the png is also written here (via a temporary file, so never seen part written)
+};
+
+
+// 5x7 pixel glyphs for ascii 32 to 126; each byte is a column, with bit 0 the top row
+constexpr std::array<std::array<std::uint8_t, 5>, 95> font{{
+  {0x00,0x00,0x00,0x00,0x00}, {0x00,0x00,0x5F,0x00,0x00}, {0x00,0x07,0x00,0x07,0x00}, {0x14,0x7F,0x14,0x7F,0x14}, // space ! " #
+  {0x24,0x2A,0x7F,0x2A,0x12}, {0x23,0x13,0x08,0x64,0x62}, {0x36,0x49,0x55,0x22,0x50}, {0x00,0x00,0x07,0x00,0x00}, // $ % & '
+  {0x00,0x1C,0x22,0x41,0x00}, {0x00,0x41,0x22,0x1C,0x00}, {0x14,0x08,0x3E,0x08,0x14}, {0x08,0x08,0x3E,0x08,0x08}, // ( ) * +
+  {0x00,0x50,0x30,0x00,0x00}, {0x08,0x08,0x08,0x08,0x08}, {0x00,0x60,0x60,0x00,0x00}, {0x20,0x10,0x08,0x04,0x02}, // , - . /
+  {0x3E,0x51,0x49,0x45,0x3E}, {0x00,0x42,0x7F,0x40,0x00}, {0x42,0x61,0x51,0x49,0x46}, {0x21,0x41,0x45,0x4B,0x31}, // 0 1 2 3
+  {0x18,0x14,0x12,0x7F,0x10}, {0x27,0x45,0x45,0x45,0x39}, {0x3C,0x4A,0x49,0x49,0x30}, {0x01,0x71,0x09,0x05,0x03}, // 4 5 6 7
+  {0x36,0x49,0x49,0x49,0x36}, {0x06,0x49,0x49,0x29,0x1E}, {0x00,0x36,0x36,0x00,0x00}, {0x00,0x56,0x36,0x00,0x00}, // 8 9 : ;
+  {0x08,0x14,0x22,0x41,0x00}, {0x14,0x14,0x14,0x14,0x14}, {0x00,0x41,0x22,0x14,0x08}, {0x02,0x01,0x51,0x09,0x06}, // < = > ?
+  {0x32,0x49,0x79,0x41,0x3E}, {0x7E,0x11,0x11,0x11,0x7E}, {0x7F,0x49,0x49,0x49,0x36}, {0x3E,0x41,0x41,0x41,0x22}, // @ A B C
+  {0x7F,0x41,0x41,0x22,0x1C}, {0x7F,0x49,0x49,0x49,0x41}, {0x7F,0x09,0x09,0x09,0x01}, {0x3E,0x41,0x49,0x49,0x7A}, // D E F G
+  {0x7F,0x08,0x08,0x08,0x7F}, {0x00,0x41,0x7F,0x41,0x00}, {0x20,0x40,0x41,0x3F,0x01}, {0x7F,0x08,0x14,0x22,0x41}, // H I J K
+  {0x7F,0x40,0x40,0x40,0x40}, {0x7F,0x02,0x0C,0x02,0x7F}, {0x7F,0x04,0x08,0x10,0x7F}, {0x3E,0x41,0x41,0x41,0x3E}, // L M N O
+  {0x7F,0x09,0x09,0x09,0x06}, {0x3E,0x41,0x51,0x21,0x5E}, {0x7F,0x09,0x19,0x29,0x46}, {0x46,0x49,0x49,0x49,0x31}, // P Q R S
+  {0x01,0x01,0x7F,0x01,0x01}, {0x3F,0x40,0x40,0x40,0x3F}, {0x1F,0x20,0x40,0x20,0x1F}, {0x3F,0x40,0x38,0x40,0x3F}, // T U V W
+  {0x63,0x14,0x08,0x14,0x63}, {0x07,0x08,0x70,0x08,0x07}, {0x61,0x51,0x49,0x45,0x43}, {0x00,0x7F,0x41,0x41,0x00}, // X Y Z [
+  {0x02,0x04,0x08,0x10,0x20}, {0x00,0x41,0x41,0x7F,0x00}, {0x04,0x02,0x01,0x02,0x04}, {0x40,0x40,0x40,0x40,0x40}, // \ ] ^ _
+  {0x00,0x01,0x02,0x04,0x00}, {0x20,0x54,0x54,0x54,0x78}, {0x7F,0x48,0x44,0x44,0x38}, {0x38,0x44,0x44,0x44,0x20}, // ` a b c
+  {0x38,0x44,0x44,0x48,0x7F}, {0x38,0x54,0x54,0x54,0x18}, {0x08,0x7E,0x09,0x01,0x02}, {0x0C,0x52,0x52,0x52,0x3E}, // d e f g
+  {0x7F,0x08,0x04,0x04,0x78}, {0x00,0x44,0x7D,0x40,0x00}, {0x20,0x40,0x44,0x3D,0x00}, {0x7F,0x10,0x28,0x44,0x00}, // h i j k
+  {0x00,0x41,0x7F,0x40,0x00}, {0x7C,0x04,0x18,0x04,0x78}, {0x7C,0x08,0x04,0x04,0x78}, {0x38,0x44,0x44,0x44,0x38}, // l m n o
+  {0x7C,0x14,0x14,0x14,0x08}, {0x08,0x14,0x14,0x18,0x7C}, {0x7C,0x08,0x04,0x04,0x08}, {0x48,0x54,0x54,0x54,0x20}, // p q r s
+  {0x04,0x3F,0x44,0x40,0x20}, {0x3C,0x40,0x40,0x20,0x7C}, {0x1C,0x20,0x40,0x20,0x1C}, {0x3C,0x40,0x30,0x40,0x3C}, // t u v w
+  {0x44,0x28,0x10,0x28,0x44}, {0x0C,0x50,0x50,0x50,0x3C}, {0x44,0x64,0x54,0x4C,0x44}, {0x00,0x08,0x36,0x41,0x00}, // x y z {
+  {0x00,0x00,0x7F,0x00,0x00}, {0x00,0x41,0x36,0x08,0x00}, {0x08,0x04,0x08,0x10,0x08},                              // | } ~
+}};
+
+
+// An rgb image, into which plots are drawn
+class image
+{
+public:
+
+  image(const std::size_t width, const std::size_t height) : width_{width}, height_{height}, pixels_(width * height * 3, 255) {}
+
+  std::size_t width()  const noexcept { return width_; }
+  std::size_t height() const noexcept { return height_; }
+
+  // fill a square of side size centred on (x, y), clipped to the given region
+  void dot(const double x, const double y, const int size, const colour c, const std::array<double, 4>& clip) noexcept
+  {
+    const double half = (size - 1) / 2.0;
+
+    const auto from_x = static_cast<std::int64_t>(std::max(std::round(x - half), clip[0]));
+    const auto to_x   = static_cast<std::int64_t>(std::min(std::round(x + half), clip[2]));
+    const auto from_y = static_cast<std::int64_t>(std::max(std::round(y - half), clip[1]));
+    const auto to_y   = static_cast<std::int64_t>(std::min(std::round(y + half), clip[3]));
+
+    for (std::int64_t py = from_y; py <= to_y; ++py)
+      for (std::int64_t px = from_x; px <= to_x; ++px)
+        set(static_cast<std::size_t>(px), static_cast<std::size_t>(py), c);
+  }
+
+  // straight line from (x0, y0) to (x1, y1), with the given thickness, clipped to the given region
+  void segment(const double x0, const double y0, const double x1, const double y1, const int thickness, const colour c, const std::array<double, 4>& clip) noexcept
+  {
+    if (!std::isfinite(x0) || !std::isfinite(y0) || !std::isfinite(x1) || !std::isfinite(y1))
+      return;
+
+    // skip segments entirely outside the clip region (without this, far off lines would still be stepped along)
+    if (std::max(x0, x1) < clip[0] || std::min(x0, x1) > clip[2] || std::max(y0, y1) < clip[1] || std::min(y0, y1) > clip[3])
+      return;
+
+    const double steps = std::min(std::ceil(std::max(std::abs(x1 - x0), std::abs(y1 - y0))), 1e5);
+
+    for (double s = 0; s <= steps; ++s)
+    {
+      const double t = steps > 0 ? s / steps : 0.0;
+
+      dot(x0 + t * (x1 - x0), y0 + t * (y1 - y0), thickness, c, clip);
+    }
+  }
+
+  // text with its top left corner at (x, y), each font pixel drawn scale pixels across
+  void text(const std::size_t x, const std::size_t y, const std::string_view str, const std::size_t scale, const colour c) noexcept
+  {
+    for (std::size_t i = 0; i < str.size(); ++i)
+    {
+      const auto character = static_cast<unsigned char>(str[i]);
+
+      const auto& glyph = font[character >= 32 && character <= 126 ? character - 32 : '?' - 32];
+
+      for (std::size_t column = 0; column < 5; ++column)
+        for (std::size_t row = 0; row < 7; ++row)
+          if (glyph[column] >> row & 1)
+            for (std::size_t dy = 0; dy < scale; ++dy)
+              for (std::size_t dx = 0; dx < scale; ++dx)
+                set(x + (6 * i + column) * scale + dx, y + row * scale + dy, c);
+    }
+  }
+
+  static constexpr std::size_t text_width(const std::string_view str, const std::size_t scale) noexcept
+  {
+    return str.empty() ? 0 : (6 * str.size() - 1) * scale;
+  }
+
+  // png encoding of the image (8 bit rgb, compressed with zlib)
+  std::vector<unsigned char> png() const
+  {
+    // each row is preceded by its filter type (0, none)
+    std::vector<unsigned char> raw{};
+
+    raw.reserve(height_ * (width_ * 3 + 1));
+
+    for (std::size_t y = 0; y < height_; ++y)
+    {
+      raw.push_back(0);
+
+      raw.insert(raw.end(), pixels_.begin() + static_cast<std::ptrdiff_t>(y * width_ * 3), pixels_.begin() + static_cast<std::ptrdiff_t>((y + 1) * width_ * 3));
+    }
+
+    uLongf compressed_size = compressBound(static_cast<uLong>(raw.size()));
+
+    std::vector<unsigned char> compressed(compressed_size);
+
+    if (compress2(compressed.data(), &compressed_size, raw.data(), static_cast<uLong>(raw.size()), 6) != Z_OK)
+    {
+      fmt::print(fmt::emphasis::bold | fg(fmt::color::red), "ERROR: compression of png image data failed\n");
+
+      std::exit(1);
+    }
+
+    compressed.resize(compressed_size);
+
+    std::vector<unsigned char> out{0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+
+    auto append_u32 = [](std::vector<unsigned char>& dest, const std::size_t val)
+    {
+      for (int shift = 24; shift >= 0; shift -= 8)
+        dest.push_back(static_cast<unsigned char>(val >> shift));
+    };
+
+    auto append_chunk = [&](const std::string_view type, const std::vector<unsigned char>& data)
+    {
+      append_u32(out, data.size());
+
+      const std::size_t start = out.size();
+
+      out.insert(out.end(), type.begin(), type.end());
+      out.insert(out.end(), data.begin(), data.end());
+
+      append_u32(out, crc32(0, out.data() + start, static_cast<uInt>(out.size() - start)));
+    };
+
+    std::vector<unsigned char> header{};
+
+    append_u32(header, width_);
+    append_u32(header, height_);
+
+    header.insert(header.end(), {8, 2, 0, 0, 0}); // bit depth, colour type (rgb), compression, filter, interlace
+
+    append_chunk("IHDR", header);
+    append_chunk("IDAT", compressed);
+    append_chunk("IEND", {});
+
+    return out;
+  }
+
+private:
+
+  void set(const std::size_t x, const std::size_t y, const colour c) noexcept
+  {
+    if (x >= width_ || y >= height_)
+      return;
+
+    unsigned char* const pixel = &pixels_[(y * width_ + x) * 3];
+
+    pixel[0] = c.r;
+    pixel[1] = c.g;
+    pixel[2] = c.b;
+  }
+
+  std::size_t                width_;
+  std::size_t                height_;
+  std::vector<unsigned char> pixels_;
+}; // class image
+
+
+// spacing of about target_count axis ticks over range, of the form {1, 2, 5} * 10^n
+inline double tick_spacing(const double range, const double target_count) noexcept
+{
+  const double raw = range / target_count;
+
+  const double magnitude = std::pow(10.0, std::floor(std::log10(raw)));
+
+  for (const double multiple : {1.0, 2.0, 5.0})
+    if (raw <= multiple * magnitude)
+      return multiple * magnitude;
+
+  return 10.0 * magnitude;
+}
+
+
+// draw a plot, with axes scaled to contain all of its lines
+inline image render(const plot& p)
+{
+  image out{p.width, p.height};
+
+  constexpr std::size_t text_scale{2};
+
+  // plot area, in pixels
+  const double left   = 110;
+  const double top    = 50;
+  const double right  = static_cast<double>(p.width)  - 30;
+  const double bottom = static_cast<double>(p.height) - 60;
+
+  double min_x{ std::numeric_limits<double>::infinity()};
+  double max_x{-std::numeric_limits<double>::infinity()};
+  double min_y{0};
+  double max_y{-std::numeric_limits<double>::infinity()};
+
+  for (const line& l : p.lines)
+    for (const auto& [x, y] : l.points)
+      if (std::isfinite(x) && std::isfinite(y))
+      {
+        min_x = std::min(min_x, x);
+        max_x = std::max(max_x, x);
+        min_y = std::min(min_y, y);
+        max_y = std::max(max_y, y);
+      }
+
+  if (!(max_x > min_x))
+  {
+    min_x = std::isfinite(min_x) ? min_x - 1 : 0;
+    max_x = min_x + 2;
+  }
+
+  if (!(max_y > min_y))
+    max_y = min_y + 1;
+
+  max_y += 0.05 * (max_y - min_y); // leave room above the highest point (for labels)
+
+  auto to_x = [&](const double x){ return left   + (x - min_x) / (max_x - min_x) * (right  - left); };
+  auto to_y = [&](const double y){ return bottom - (y - min_y) / (max_y - min_y) * (bottom - top ); };
+
+  const std::array<double, 4> plot_area{left, top, right, bottom};
+  const std::array<double, 4> whole_image{0, 0, static_cast<double>(p.width) - 1, static_cast<double>(p.height) - 1};
+
+  // ticks, with grid lines and labels
+  {
+    const double x_spacing = tick_spacing(max_x - min_x, 10);
+    const double y_spacing = tick_spacing(max_y - min_y, 8);
+
+    for (double x = std::ceil(min_x / x_spacing) * x_spacing; x <= max_x; x += x_spacing)
+    {
+      out.segment(to_x(x), top, to_x(x), bottom, 1, grey, plot_area);
+      out.segment(to_x(x), bottom, to_x(x), bottom + 8, 1, black, whole_image);
+
+      const std::string text{fmt::format("{:g}", std::abs(x) < x_spacing / 2 ? 0.0 : x)};
+
+      const auto text_x = std::max(0.0, to_x(x) - static_cast<double>(image::text_width(text, text_scale)) / 2);
+
+      out.text(static_cast<std::size_t>(text_x), static_cast<std::size_t>(bottom + 14), text, text_scale, black);
+    }
+
+    for (double y = std::ceil(min_y / y_spacing) * y_spacing; y <= max_y; y += y_spacing)
+    {
+      out.segment(left, to_y(y), right, to_y(y), 1, grey, plot_area);
+      out.segment(left - 8, to_y(y), left, to_y(y), 1, black, whole_image);
+
+      const std::string text{fmt::format("{:g}", std::abs(y) < y_spacing / 2 ? 0.0 : y)};
+
+      const auto text_x = std::max(0.0, left - 12 - static_cast<double>(image::text_width(text, text_scale)));
+
+      out.text(static_cast<std::size_t>(text_x), static_cast<std::size_t>(std::max(0.0, to_y(y) - 7)), text, text_scale, black);
+    }
+  }
+
+  for (const line& l : p.lines)
+    for (std::size_t i = 1; i < l.points.size(); ++i)
+      out.segment(to_x(l.points[i - 1].first), to_y(l.points[i - 1].second), to_x(l.points[i].first), to_y(l.points[i].second), l.width, l.colour, plot_area);
+
+  // frame
+  out.segment(left,  top,    right, top,    2, black, whole_image);
+  out.segment(left,  bottom, right, bottom, 2, black, whole_image);
+  out.segment(left,  top,    left,  bottom, 2, black, whole_image);
+  out.segment(right, top,    right, bottom, 2, black, whole_image);
+
+  for (const label& l : p.labels)
+  {
+    const double x = std::clamp(to_x(l.x), 0.0, static_cast<double>(p.width));
+    const double y = std::clamp(to_y(l.y) - 7.0 * text_scale - 4, 0.0, static_cast<double>(p.height));
+
+    out.text(static_cast<std::size_t>(x), static_cast<std::size_t>(y), l.text, text_scale, black);
+  }
+
+  const auto title_x = std::max(0.0, (static_cast<double>(p.width) - static_cast<double>(image::text_width(p.title, 3))) / 2);
+
+  out.text(static_cast<std::size_t>(title_x), 12, p.title, 3, black);
+
+  return out;
+}
+
+
+// Queue of plots, rendered and written to file by worker threads
+class plotter
+{
+public:
+
+  explicit plotter(const std::size_t worker_count = 2)
+  {
+    workers_.reserve(worker_count);
+
+    for (std::size_t i = 0; i < worker_count; ++i)
+      workers_.emplace_back([this]{ work(); });
+  }
+
+  plotter(const plotter&) = delete;
+  plotter& operator=(const plotter&) = delete;
+
+  // render every plot still queued, then stop the workers
+  ~plotter()
+  {
+    {
+      const std::scoped_lock lock(mutex_);
+
+      stopping_ = true;
+    }
+
+    available_.notify_all();
+
+    workers_.clear(); // joins
+  }
+
+  // queue a plot for rendering (returns without waiting for it)
+  void submit(plot p)
+  {
+    {
+      const std::scoped_lock lock(mutex_);
+
+      queue_.push_back(std::move(p));
+    }
+
+    available_.notify_one();
+  }
+
+private:
+
+  void work()
+  {
+    while (true)
+    {
+      plot p;
+
+      {
+        std::unique_lock lock(mutex_);
+
+        available_.wait(lock, [&]{ return stopping_ || !queue_.empty(); });
+
+        if (queue_.empty())
+          return;
+
+        p = std::move(queue_.front());
+
+        queue_.pop_front();
+      }
+
+      const std::vector<unsigned char> png = render(p).png();
+
+      auto write = [&](const std::string& path)
+      {
+        std::ofstream out{path, std::ios::binary};
+
+        out.write(reinterpret_cast<const char*>(png.data()), static_cast<std::streamsize>(png.size()));
+
+        if (!out)
+        {
+          fmt::print(fmt::emphasis::bold | fg(fmt::color::red), "ERROR: failed to write plot {}\n", path);
+
+          std::exit(1);
+        }
+      };
+
+      write(p.path);
+
+      if (!p.copy_path.empty())
+      {
+        const std::string temporary_path{p.copy_path + ".tmp"};
+
+        write(temporary_path);
+
+        if (std::rename(temporary_path.c_str(), p.copy_path.c_str()))
+        {
+          fmt::print(fmt::emphasis::bold | fg(fmt::color::red), "ERROR: failed to rename plot {} to {}\n", temporary_path, p.copy_path);
+
+          std::exit(1);
+        }
+      }
+    }
+  }
+
+  std::mutex                mutex_;
+  std::condition_variable   available_;
+  std::deque<plot>          queue_;
+  bool                      stopping_{false};
+  std::vector<std::jthread> workers_;
+}; // class plotter
+} // namespace plotting
@@ -0,0 +1,138 @@
+#pragma once
+
+#include "fitting.hpp"
+
+#include "timeblit/random.hpp"
+
+#include <fmt/format.h>
+#include <fmt/color.h>
+
+#include <vector>
+#include <array>
+#include <cmath>
+#include <limits>
+#include <algorithm>
+
+
+// Gaussian mixture fitting by random search (as originally done in fit.cpp)
+//
+// Each step proposes a new set of peaks, by removing, moving, scaling or widening a random peak, or by adding a peak at
+// the largest residual with a randomly searched width. Proposals are kept only if they improve the fit.
+//
+// The random walks searching a new peak's width are run by loop(count, func) (as serial_loop), so that a caller can share
+// them with threads that have run out of work.
+
+
+template<std::size_t N, class Loop = serial_loop>
+fit_result fit_random_search(const std::array<double, N>& distribution, const grid_t& grid, const Loop& loop = {}, const std::size_t steps = 50000)
+{
+  using namespace movency;
+  using namespace random;
+
+  const double span = grid.step * static_cast<double>(N - 1);
+
+  fit_result out{{}, std::numeric_limits<double>::infinity(), 0};
+
+  auto generate_new_peaks = [&]
+  {
+    auto new_peaks = out.peaks;
+
+    //if (std::ssize(new_peaks) > 0 && (std::ssize(new_peaks) > 10 || std::bernoulli_distribution(0.9)(prng_)))
+    //if (new_peaks.size() > 1 && std::bernoulli_distribution(1.0 - std::pow(0.4, new_peaks.size()))(prng_))
+    if (new_peaks.size() > 1 && random::fast(uniform_distribution<bool>(1.0 - std::pow(0.4, new_peaks.size()))))
+    {
+      // index of gaussian to alter
+      const std::size_t change_index = random::fast(uniform_distribution(0ul, new_peaks.size() - 1));
+
+      //if (std::bernoulli_distribution(0.25)(prng_))
+      if (random::fast(uniform_distribution<bool>(0.25)))
+      {
+        new_peaks.erase(new_peaks.begin() + static_cast<std::int64_t>(change_index));
+      }
+      //else if (std::bernoulli_distribution(0.1)(prng_))
+      else if (random::fast(uniform_distribution<bool>(0.1)))
+      {
+        new_peaks[change_index].position += random::fast(uniform_distribution(-span/100, span/100));
+      }
+      //else if (std::bernoulli_distribution(0.5)(prng_))
+      else if (random::fast<bool>())
+      {
+        new_peaks[change_index].magnitude *= random::fast(uniform_distribution(0.5, 2.0));
+      }
+      else
+      {
+        new_peaks[change_index].width *= random::fast(uniform_distribution(0.5, 2.0));
+      }
+    }
+    else
+    {
+      const auto residuals = [&]
+      {
+        std::array<double, N> res{distribution};
+
+        for (const peak_t& peak : new_peaks)
+          add_peak(res, grid, peak, -1.0);
+
+        return res;
+      }();
+
+      ++out.evaluations;
+
+      const double residuals_sum_of_squares = sum_of_squares(residuals);
+
+      const auto max_idx = static_cast<std::size_t>(std::ranges::max_element(residuals) - residuals.begin());
+
+      const double position = grid[max_idx];
+
+      const double magnitude = residuals[max_idx];
+
+      std::array<std::uint64_t, width_walks> seeds;
+
+      for (auto& seed : seeds)
+        seed = random::fast(uniform_distribution(std::uint64_t{0}, std::numeric_limits<std::uint64_t>::max()));
+
+      const auto [best_width, best_fit] = search_width(residuals, residuals_sum_of_squares, grid, position, magnitude, seeds, loop);
+
+      out.evaluations += width_walks * width_walk_steps;
+
+      if (best_fit == std::numeric_limits<double>::infinity())
+        fmt::print(fmt::emphasis::bold | fg(fmt::color::red), "ERROR: no change in best_fit when attempting to add a new curve\n");
+      else
+        new_peaks.emplace_back(position, magnitude, best_width);
+    }
+
+    return new_peaks;
+  };
+
+  auto evaluate_fit = [&](const auto& new_peaks)
+  {
+    std::array<double, N> vals;
+
+    evaluate_mixture(vals, grid, new_peaks);
+
+    ++out.evaluations;
+
+    double fit{};
+
+    for (std::size_t i = 0; i < N; ++i)
+      fit += pow<2>(vals[i] - distribution[i]);
+
+    return fit;
+  };
+
+  for (std::size_t i = 0; i < steps; ++i)
+  {
+    auto new_peaks = generate_new_peaks();
+
+    const double new_fit = evaluate_fit(new_peaks);
+
+    if (new_fit >= out.fit)
+      continue;
+
+    out.fit = new_fit;
+
+    out.peaks = std::move(new_peaks);
+  }
+
+  return out;
+}
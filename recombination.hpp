@@ -0,0 +1,456 @@
+#pragma once
+
+#include "root.hpp"
+#include "fitting.hpp"
+#include "threading.hpp"
+
+#include <fmt/format.h>
+#include <fmt/color.h>
+
+#include <array>
+#include <vector>
+#include <span>
+#include <string>
+#include <string_view>
+#include <cmath>
+#include <algorithm>
+#include <cstdlib>
+
+
+// Invariant masses of the recombinations of the four daughter particles, under each hypothesis of their masses
+//
+// Each daughter is either left out (hypothesis 0) or given the mass of one of the hypothesised particles, and each
+// recombination is named {a}_{b}_{c}_{d} after the hypotheses of the four daughters in order. The daughters' momenta
+// are read as whole columns, and masses are computed simd::width events at a time: each daughter's energy under each
+// hypothesis once per event, then the four momentum of every recombination.
+//
+// Recombinations share most of their partial sums, so these follow a plan made at compile time (sums): each
+// recombination is the sum of a node for its first two daughters and a node for its last two, where a node is a single
+// daughter's four momentum or the sum of two, and each pair node is summed once per event however many use it.
+//
+// mass_columns provides the mass of any one recombination on demand, computed from the momenta in memory, so that the
+// several hundred columns of cache/mass.root need not be written out (and read back) by programs taking one at a time.
+
+
+namespace recombination
+{
+using namespace std::literals;
+
+constexpr double z_mass  = 0;
+//constexpr double e_mass  = 0.51099895000; //unused
+constexpr double mu_mass = 105.6583755;
+constexpr double pi_mass = 139.57039;
+constexpr double k_mass  = 493.677;
+constexpr double p_mass  = 938.27208816;
+
+constexpr std::array masses{z_mass, mu_mass, pi_mass, k_mass, p_mass};
+
+constexpr std::array names {"0"sv, "mu"sv, "pi"sv, "k"sv, "p"sv};
+
+static_assert(masses.size() == names.size());
+
+constexpr std::size_t preds_count{names.size()};
+
+// the four daughters, as named in the input trees (whose momenta are <name>_PX, <name>_PY and <name>_PZ)
+constexpr std::array daughter_names{"h1"sv, "h2"sv, "mu1"sv, "mu2"sv}; // p, K, mu, mu
+
+// the files whose events are recombined, in order
+constexpr std::array input_files{"../data/Lb2pKmm_mgUp_2016_UID.root"sv,
+                                 "../data/Lb2pKmm_mgDn_2016_UID.root"sv,
+                                 "../data/Lb2pKmm_mgUp_2017_UID.root"sv,
+                                 "../data/Lb2pKmm_mgDn_2017_UID.root"sv,
+                                 "../data/Lb2pKmm_mgUp_2018_UID.root"sv,
+                                 "../data/Lb2pKmm_mgDn_2018_UID.root"sv};
+
+// runs a function for every possible recombination of daughter particles
+constexpr void for_all_recombinations(auto func)
+{
+  static_assert(std::invocable<decltype(func), std::uint32_t, std::uint32_t, std::uint32_t, std::uint32_t>, "for_all_recombinations must be passed a function which takes 4 std::uint32_t inputs.");
+
+  for (std::uint32_t ap = 0; ap < preds_count; ++ap)
+  for (std::uint32_t bp = 0; bp < preds_count; ++bp)
+  for (std::uint32_t cp = 0; cp < preds_count; ++cp)
+  for (std::uint32_t dp = 0; dp < preds_count; ++dp)
+  {
+    // skip if only 1 or 0 particles
+    {
+      int p_count = 0;
+
+      p_count += ap != 0;
+      p_count += bp != 0;
+      p_count += cp != 0;
+      p_count += dp != 0;
+
+      if (p_count <= 1)
+        continue;
+    }
+
+    // skip if combined particle would have charge of +-2
+    if (ap == 0 && bp != 0 && cp == 0 && dp != 0)
+      continue;
+
+    if (ap != 0 && bp == 0 && cp != 0 && dp == 0)
+      continue;
+
+    func(ap, bp, cp, dp);
+  }
+}
+
+// the hypotheses of the four daughters in each recombination, in the order for_all_recombinations visits them
+constexpr auto recombinations = []
+{
+  constexpr std::size_t count = []
+  {
+    std::size_t out{0};
+
+    for_all_recombinations([&](std::uint32_t, std::uint32_t, std::uint32_t, std::uint32_t){ ++out; });
+
+    return out;
+  }();
+
+  std::array<std::array<std::uint32_t, 4>, count> out{};
+
+  std::size_t i{0};
+
+  for_all_recombinations([&](const std::uint32_t ap, const std::uint32_t bp, const std::uint32_t cp, const std::uint32_t dp){ out[i++] = {ap, bp, cp, dp}; });
+
+  return out;
+}();
+
+constexpr std::size_t recombination_count{recombinations.size()};
+
+// the partial sums shared between recombinations
+struct sum_plan
+{
+  static constexpr std::uint32_t none{~0u}; // a half of a recombination with no daughters in it
+
+  static constexpr std::size_t leaf_count{4 * (preds_count - 1)}; // a node for each daughter under each non-zero hypothesis
+
+  static constexpr std::size_t max_pair_count{2 * (preds_count - 1) * (preds_count - 1)};
+
+  std::array<std::array<std::uint32_t, 2>, max_pair_count> pairs{}; // node leaf_count + i is the sum of nodes pairs[i]
+  std::size_t                                              pair_count{0};
+
+  std::array<std::array<std::uint32_t, 2>, recombination_count> halves{}; // nodes summed for each recombination
+
+  static constexpr std::uint32_t leaf(const std::size_t daughter, const std::uint32_t hypothesis) noexcept
+  {
+    return static_cast<std::uint32_t>(daughter * (preds_count - 1) + hypothesis - 1);
+  }
+
+  // node for daughters first and first + 1 under the given hypotheses, added if not already present
+  constexpr std::uint32_t half(const std::size_t first, const std::uint32_t a, const std::uint32_t b) noexcept
+  {
+    if (a == 0 || b == 0)
+      return a != 0 ? leaf(first, a) : b != 0 ? leaf(first + 1, b) : none;
+
+    const std::array<std::uint32_t, 2> pair{leaf(first, a), leaf(first + 1, b)};
+
+    std::size_t i = 0;
+
+    while (i < pair_count && pairs[i] != pair)
+      ++i;
+
+    if (i == pair_count)
+      pairs[pair_count++] = pair;
+
+    return static_cast<std::uint32_t>(leaf_count + i);
+  }
+};
+
+constexpr sum_plan sums = []
+{
+  sum_plan out{};
+
+  for (std::size_t r = 0; r < recombination_count; ++r)
+  {
+    const auto& [ap, bp, cp, dp] = recombinations[r];
+
+    out.halves[r] = {out.half(0, ap, bp), out.half(2, cp, dp)};
+  }
+
+  return out;
+}();
+
+static_assert([]
+{
+  for (const auto& [lhs, rhs] : sums.halves)
+    if (lhs == sum_plan::none && rhs == sum_plan::none)
+      return false;
+
+  return true;
+}(), "every recombination must contain a daughter");
+
+
+inline std::string name(const std::array<std::uint32_t, 4>& hypotheses)
+{
+  return fmt::format("{}_{}_{}_{}", names[hypotheses[0]], names[hypotheses[1]], names[hypotheses[2]], names[hypotheses[3]]);
+}
+
+
+// x, y and z momentum components of each daughter, for every event
+struct daughter_momenta
+{
+  std::array<std::array<std::vector<double>, 3>, 4> components;
+
+  std::size_t size() const noexcept
+  {
+    return components[0][0].size();
+  }
+};
+
+// read the momenta of the daughters from file, a column on each thread of the pool (so not to be called from the pool)
+inline daughter_momenta read_momenta(const movency::root::file& file)
+{
+  constexpr std::array axes{"PX"sv, "PY"sv, "PZ"sv};
+
+  daughter_momenta out{};
+
+  loop_threaded([&](const std::size_t index)
+  {
+    out.components[index / 3][index % 3] = file.uncompress<double>(fmt::format("{}_{}", daughter_names[index / 3], axes[index % 3]));
+  }, 12);
+
+  for (std::size_t index = 0; index < 12; ++index)
+  {
+    const auto& column = out.components[index / 3][index % 3];
+
+    if (column.empty() || column.size() != out.size())
+    {
+      fmt::print(fmt::emphasis::bold | fg(fmt::color::red), "ERROR: {} entries in {}_{}, but {} in {}_{}\n", column.size(), daughter_names[index / 3], axes[index % 3], out.size(), daughter_names[0], axes[0]);
+
+      std::exit(1);
+    }
+  }
+
+  return out;
+}
+
+
+// mass of each recombination for events [from, to), written to out[r * stride + i - from] for event i of recombination r
+// (like ROOT's LorentzVector::M, the mass is negative when the squared mass is)
+inline void compute_masses(const daughter_momenta& momenta, const std::size_t from, const std::size_t to, const std::span<double> out, const std::size_t stride) noexcept
+{
+  auto masses_at = [&]<class T>(const std::size_t i)
+  {
+    auto load = [&](const std::vector<double>& column)
+    {
+      if constexpr (std::is_same_v<T, double>)
+        return column[i];
+      else
+        return simd::load(&column[i]);
+    };
+
+    // four momentum (x, y, z, e) of each node of the plan: each daughter under each hypothesis, then the pair sums
+    std::array<std::array<T, 4>, sum_plan::leaf_count + sums.pair_count> nodes;
+
+    for (std::size_t d = 0; d < 4; ++d)
+    {
+      const T px = load(momenta.components[d][0]);
+      const T py = load(momenta.components[d][1]);
+      const T pz = load(momenta.components[d][2]);
+
+      const T p2 = px * px + py * py + pz * pz;
+
+      for (std::uint32_t m = 1; m < preds_count; ++m)
+      {
+        if constexpr (std::is_same_v<T, double>)
+          nodes[sum_plan::leaf(d, m)] = {px, py, pz, std::sqrt(p2 + masses[m] * masses[m])};
+        else
+          nodes[sum_plan::leaf(d, m)] = {px, py, pz, simd::sqrt(p2 + masses[m] * masses[m])};
+      }
+    }
+
+    for (std::size_t p = 0; p < sums.pair_count; ++p)
+      for (std::size_t c = 0; c < 4; ++c)
+        nodes[sum_plan::leaf_count + p][c] = nodes[sums.pairs[p][0]][c] + nodes[sums.pairs[p][1]][c];
+
+    for (std::size_t r = 0; r < recombination_count; ++r)
+    {
+      const auto [lhs, rhs] = sums.halves[r];
+
+      std::array<T, 4> sum;
+
+      if (lhs == sum_plan::none)
+        sum = nodes[rhs];
+      else if (rhs == sum_plan::none)
+        sum = nodes[lhs];
+      else
+        for (std::size_t c = 0; c < 4; ++c)
+          sum[c] = nodes[lhs][c] + nodes[rhs][c];
+
+      const T m2 = sum[3] * sum[3] - sum[0] * sum[0] - sum[1] * sum[1] - sum[2] * sum[2];
+
+      double* const dest = &out[r * stride + i - from];
+
+      if constexpr (std::is_same_v<T, double>)
+        *dest = m2 < 0 ? -std::sqrt(-m2) : std::sqrt(m2);
+      else
+      {
+        const T root = simd::sqrt(m2 < 0.0 ? -m2 : m2);
+
+        simd::store(dest, m2 < 0.0 ? -root : root);
+      }
+    }
+  };
+
+  std::size_t i = from;
+
+  for (; i + simd::width <= to; i += simd::width)
+    masses_at.template operator()<simd::doubles>(i);
+
+  for (; i < to; ++i)
+    masses_at.template operator()<double>(i);
+}
+
+
+// mass of the recombination with the given hypotheses for events [from, from + out.size()), written to out as floats
+inline void compute_mass(const daughter_momenta& momenta, const std::array<std::uint32_t, 4>& hypotheses, const std::span<float> out, const std::size_t from = 0) noexcept
+{
+  auto mass_at = [&]<class T>(const std::size_t i)
+  {
+    std::array<T, 4> sum{};
+
+    for (std::size_t d = 0; d < 4; ++d)
+    {
+      if (hypotheses[d] == 0)
+        continue;
+
+      std::array<T, 3> p;
+
+      for (std::size_t c = 0; c < 3; ++c)
+      {
+        if constexpr (std::is_same_v<T, double>)
+          p[c] = momenta.components[d][c][from + i];
+        else
+          p[c] = simd::load(&momenta.components[d][c][from + i]);
+
+        sum[c] += p[c];
+      }
+
+      const T energy2 = p[0] * p[0] + p[1] * p[1] + p[2] * p[2] + masses[hypotheses[d]] * masses[hypotheses[d]];
+
+      if constexpr (std::is_same_v<T, double>)
+        sum[3] += std::sqrt(energy2);
+      else
+        sum[3] += simd::sqrt(energy2);
+    }
+
+    const T m2 = sum[3] * sum[3] - sum[0] * sum[0] - sum[1] * sum[1] - sum[2] * sum[2];
+
+    if constexpr (std::is_same_v<T, double>)
+      out[i] = static_cast<float>(m2 < 0 ? -std::sqrt(-m2) : std::sqrt(m2));
+    else
+    {
+      const T root = simd::sqrt(m2 < 0.0 ? -m2 : m2);
+
+      simd::store(&out[i], m2 < 0.0 ? -root : root);
+    }
+  };
+
+  std::size_t i = 0;
+
+  for (; i + simd::width <= out.size(); i += simd::width)
+    mass_at.template operator()<simd::doubles>(i);
+
+  for (; i < out.size(); ++i)
+    mass_at.template operator()<double>(i);
+}
+
+
+// Recombination masses as columns computed when asked for, standing in for the columns of cache/mass.root
+//
+// Only the daughters' momenta (of every input file, in order) are read, when constructed. Columns are named and ordered
+// as a root file lists them, and each is computed afresh (as floats, on the asking thread) every time it is asked for,
+// so nothing is kept but the momenta. A column is computed into a buffer the caller owns (and can reuse from column to
+// column), whole or a block of events at a time. Asking for columns is thread safe.
+class mass_columns
+{
+public:
+
+  explicit mass_columns(const std::span<const std::string_view> paths = input_files)
+  {
+    for (const std::string_view path : paths)
+    {
+      const movency::root::file file{std::string{path}};
+
+      if (!file.ok())
+        fail(fmt::format("cannot read input file {}", path));
+
+      const daughter_momenta read = read_momenta(file);
+
+      for (std::size_t d = 0; d < 4; ++d)
+        for (std::size_t c = 0; c < 3; ++c)
+          momenta_.components[d][c].insert(momenta_.components[d][c].end(), read.components[d][c].begin(), read.components[d][c].end());
+    }
+
+    if (momenta_.size() == 0)
+      fail("no events in the input files");
+
+    hypotheses_.assign(recombinations.begin(), recombinations.end());
+
+    std::ranges::sort(hypotheses_, {}, [](const auto& h){ return name(h); });
+
+    name_strings_.reserve(hypotheses_.size());
+
+    for (const auto& h : hypotheses_)
+      names_.emplace_back(name_strings_.emplace_back(name(h)), momenta_.size() * sizeof(double));
+  }
+
+  mass_columns(const mass_columns&) = delete;
+  mass_columns& operator=(const mass_columns&) = delete;
+
+  // names of the columns (with the sizes in bytes they would have in cache/mass.root)
+  const std::vector<std::pair<std::string_view, std::uint64_t>>& names() const noexcept
+  {
+    return names_;
+  }
+
+  // entries in each column
+  std::size_t entries() const noexcept
+  {
+    return momenta_.size();
+  }
+
+  // the values of column index, computed into buffer (resized to hold them)
+  std::span<const float> column(const std::size_t index, std::vector<float>& buffer) const
+  {
+    buffer.resize(momenta_.size());
+
+    return block(index, 0, buffer);
+  }
+
+  // the values of the named column, such as p_k_mu_mu, computed into buffer (resized to hold them)
+  std::span<const float> column(const std::string_view column_name, std::vector<float>& buffer) const
+  {
+    const auto it = std::ranges::find(names_, column_name, [](const auto& n){ return n.first; });
+
+    if (it == names_.end())
+      fail(fmt::format("no recombination called {}", column_name));
+
+    return column(static_cast<std::size_t>(it - names_.begin()), buffer);
+  }
+
+  // the values of column index for events [from, from + out.size()), computed into out
+  std::span<const float> block(const std::size_t index, const std::size_t from, const std::span<float> out) const noexcept
+  {
+    compute_mass(momenta_, hypotheses_[index], out, from);
+
+    return out;
+  }
+
+private:
+
+  [[noreturn]] static void fail(const std::string_view reason)
+  {
+    fmt::print(fmt::emphasis::bold | fg(fmt::color::red), "ERROR: mass columns: {}\n", reason);
+
+    std::exit(1);
+  }
+
+  daughter_momenta                                        momenta_{};
+  std::vector<std::array<std::uint32_t, 4>>               hypotheses_{};
+  std::vector<std::string>                                name_strings_{};
+  std::vector<std::pair<std::string_view, std::uint64_t>> names_{};
+};
+} // namespace recombination
@@ -0,0 +1,213 @@
+#pragma once
+
+#include "fitting.hpp"
+
+#include <fmt/format.h>
+#include <fmt/color.h>
+
+#include <vector>
+#include <array>
+#include <span>
+#include <string>
+#include <string_view>
+#include <optional>
+#include <fstream>
+#include <filesystem>
+#include <thread>
+#include <functional>
+#include <bit>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <type_traits>
+
+
+// Persistent cache of per-variable fit results, so that rerunning a fitter only refits the variables whose inputs changed
+//
+// Results are keyed by a hash of everything a fit depends on (the column's values, the event weights, the starting
+// peaks and the fitter's configuration, including a version to bump whenever the fitting code changes its results).
+// Each result is kept as cache/results/<key>.bin (its peaks), along with cache/results/<key>.png (its plot) once that
+// has been written.
+
+
+// 64 bit hash of a sequence of values, mixing 8 bytes at a time (fast, but not cryptographic)
+class hasher
+{
+public:
+
+  hasher& add(const std::span<const std::byte> bytes) noexcept
+  {
+    std::size_t i = 0;
+
+    for (; i + 8 <= bytes.size(); i += 8)
+    {
+      std::uint64_t word;
+
+      std::memcpy(&word, &bytes[i], 8);
+
+      mix(word);
+    }
+
+    if (i < bytes.size())
+    {
+      std::uint64_t word{0};
+
+      std::memcpy(&word, &bytes[i], bytes.size() - i);
+
+      mix(word);
+    }
+
+    length_ += bytes.size();
+
+    return *this;
+  }
+
+  // values must not contain padding (whose bytes are unspecified), so add the members of padded structs one by one
+  template<class T> requires std::is_trivially_copyable_v<T>
+  hasher& add(const std::span<const T> vals) noexcept
+  {
+    return add(std::as_bytes(vals));
+  }
+
+  template<class T> requires std::is_trivially_copyable_v<T>
+  hasher& add(const T& val) noexcept
+  {
+    return add(std::span<const T>{&val, 1});
+  }
+
+  hasher& add(const std::string_view str) noexcept
+  {
+    add(str.size());
+
+    return add(std::as_bytes(std::span{str}));
+  }
+
+  std::uint64_t digest() const noexcept
+  {
+    // murmur3 finaliser
+    std::uint64_t out = state_ ^ length_;
+
+    out ^= out >> 33;
+    out *= 0xff51afd7ed558ccdull;
+    out ^= out >> 33;
+    out *= 0xc4ceb9fe1a85ec53ull;
+    out ^= out >> 33;
+
+    return out;
+  }
+
+private:
+
+  void mix(const std::uint64_t word) noexcept
+  {
+    state_ = std::rotl(state_ ^ (word * 0x87c37b91114253d5ull), 31) * 0x4cf5ad432745937full;
+  }
+
+  std::uint64_t state_{0x9e3779b97f4a7c15ull};
+  std::uint64_t length_{0};
+};
+
+
+class result_cache
+{
+public:
+
+  explicit result_cache(std::string directory = "cache/results")
+    : directory_{std::move(directory)}
+  {
+    std::filesystem::create_directories(directory_);
+  }
+
+  // peaks stored for key, if any
+  std::optional<std::vector<peak_t>> find(const std::uint64_t key) const
+  {
+    std::ifstream in{path(key, "bin"), std::ios::binary};
+
+    if (!in)
+      return std::nullopt;
+
+    std::array<char, 8> file_magic;
+    std::uint32_t       file_version;
+    std::uint64_t       count;
+
+    in.read(file_magic.data(), file_magic.size());
+    in.read(reinterpret_cast<char*>(&file_version), sizeof(file_version));
+    in.read(reinterpret_cast<char*>(&count), sizeof(count));
+
+    if (!in || file_magic != magic || file_version != version || count > max_peaks)
+      return std::nullopt;
+
+    std::vector<peak_t> peaks(count);
+
+    in.read(reinterpret_cast<char*>(peaks.data()), static_cast<std::streamsize>(count * sizeof(peak_t)));
+
+    if (!in)
+      return std::nullopt;
+
+    return peaks;
+  }
+
+  // keep peaks for key (written to a temporary file then renamed, so a result is never seen half written)
+  void store(const std::uint64_t key, const std::span<const peak_t> peaks) const
+  {
+    const std::string final_path{path(key, "bin")};
+
+    const std::string temporary_path{fmt::format("{}.{}.tmp", final_path, std::hash<std::thread::id>{}(std::this_thread::get_id()))};
+
+    {
+      std::ofstream out{temporary_path, std::ios::binary};
+
+      const auto count = static_cast<std::uint64_t>(peaks.size());
+
+      out.write(magic.data(), magic.size());
+      out.write(reinterpret_cast<const char*>(&version), sizeof(version));
+      out.write(reinterpret_cast<const char*>(&count), sizeof(count));
+      out.write(reinterpret_cast<const char*>(peaks.data()), static_cast<std::streamsize>(peaks.size_bytes()));
+
+      if (!out)
+      {
+        fmt::print(fmt::emphasis::bold | fg(fmt::color::red), "ERROR: failed to write cached result {}\n", temporary_path);
+
+        std::exit(1);
+      }
+    }
+
+    if (std::rename(temporary_path.c_str(), final_path.c_str()))
+    {
+      fmt::print(fmt::emphasis::bold | fg(fmt::color::red), "ERROR: failed to rename cached result {} to {}\n", temporary_path, final_path);
+
+      std::exit(1);
+    }
+  }
+
+  // where the plot of key's result is kept
+  std::string plot_path(const std::uint64_t key) const
+  {
+    return path(key, "png");
+  }
+
+  // copy the plot kept for key to destination, returning false if there is none
+  bool copy_plot(const std::uint64_t key, const std::string& destination) const
+  {
+    std::error_code error{};
+
+    std::filesystem::copy_file(plot_path(key), destination, std::filesystem::copy_options::overwrite_existing, error);
+
+    return !error;
+  }
+
+private:
+
+  static constexpr std::array<char, 8> magic{'f', 'i', 't', 'c', 'a', 'c', 'h', 'e'};
+
+  static constexpr std::uint32_t version{1};
+
+  static constexpr std::uint64_t max_peaks{1 << 20}; // more than this means the file is not a result
+
+  std::string path(const std::uint64_t key, const std::string_view extension) const
+  {
+    return fmt::format("{}/{:016x}.{}", directory_, key, extension);
+  }
+
+  std::string directory_;
+};
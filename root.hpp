@@ -21,6 +21,9 @@
 #include <array>
 #include <limits>
 #include <fstream>
+#include <algorithm>
+#include <type_traits>
+#include <cstdlib>
 
 namespace std {
 
@@ -214,6 +217,9 @@ namespace root {
     std::string_view           Title;     // An optional Title
     std::span<const std::byte> DATA;      // The data store for this record (if we've read enough bytes)
 
+    std::int32_t               NevBufSize{0}; // For a TBasket: the size in bytes of each entry (if all are the same size)
+    std::int32_t               NevBuf{0};     // For a TBasket: the number of entries it holds
+
     std::uint64_t base;
     bool          ok{false};
 
@@ -279,6 +285,18 @@ namespace root {
       ok &= read_from_and_subspan(Name,      source);
       ok &= read_from_and_subspan(Title,     source);
 
+      // A TBasket's key is followed by its version, buffer size, entry size, and number of entries
+      if (ok && ClassName == "TBasket")
+      {
+        std::int16_t basket_version;
+        std::int32_t buffer_size;
+
+        auto basket = source;
+
+        if (read_from_be_and_subspan(basket_version, basket) && read_from_be_and_subspan(buffer_size, basket) && read_from_be_and_subspan(NevBufSize, basket))
+          read_from_be_and_subspan(NevBuf, basket);
+      }
+
       // Sometimes a record has more entry following Title which are part of the Key and the DATA part is after this
 
       const auto bytes_read = static_cast<std::uint16_t>(source.data() - start);
@@ -571,6 +589,80 @@ namespace root {
     }
 
 
+    // bytes per entry of a matching Name (0 if unknown), as recorded by the TBasket's holding it
+    std::uint32_t get_entry_size(std::string_view id) const noexcept
+    {
+      const auto it = baskets_.find(id);
+
+      if (it == baskets_.end())
+      {
+        fmt::print("Unable to find baskets for: {}\n", id);
+        return {};
+      }
+
+      return it->second.entry_size;
+    }
+
+
+    // number of entries of a matching Name (exits if its baskets do not all hold whole entries of one size)
+    std::size_t get_entries(std::string_view id) const noexcept
+    {
+      return get_size<std::byte>(id) / checked_entry_size(id);
+    }
+
+
+    // number of baskets a matching Name is spread over (0 if it has none)
+    std::size_t get_basket_count(std::string_view id) const noexcept
+    {
+      const auto it = baskets_.find(id);
+
+      if (it == baskets_.end())
+      {
+        fmt::print("Unable to find baskets for: {}\n", id);
+        return {};
+      }
+
+      return it->second.cycles.size();
+    }
+
+
+    // uncompress all records for a matching Name stored as either floats or doubles (going by their entry size),
+    // converted to T (exits if it is stored as neither)
+    template<class T>
+    std::vector<T> uncompress_floating(std::string_view id) const noexcept
+    {
+      const std::uint32_t entry_size = checked_entry_size(id);
+
+      if (entry_size != sizeof(float) && entry_size != sizeof(double))
+      {
+        fmt::print(fmt::emphasis::bold | fg(fmt::color::red), "ERROR: entries of {} are {} bytes, so neither floats nor doubles\n", id, entry_size);
+        std::exit(1);
+      }
+
+      auto convert = [&]<class Stored>()
+      {
+        if constexpr (std::is_same_v<T, Stored>)
+          return uncompress<Stored>(id);
+        else
+        {
+          const std::vector<Stored> stored = uncompress<Stored>(id);
+
+          std::vector<T> r(stored.size());
+
+          for (std::size_t i = 0; i != stored.size(); ++i)
+            r[i] = static_cast<T>(stored[i]);
+
+          return r;
+        }
+      };
+
+      if (entry_size == sizeof(float))
+        return convert.template operator()<float>();
+      else
+        return convert.template operator()<double>();
+    }
+
+
     // uncompress all records for a matching Name
 
     template<class T>
@@ -747,6 +839,27 @@ namespace root {
   private:
 
 
+    // bytes per entry of a matching Name, exiting if that is unknown or its baskets disagree with it
+    std::uint32_t checked_entry_size(std::string_view id) const noexcept
+    {
+      const auto it = baskets_.find(id);
+
+      if (it == baskets_.end())
+      {
+        fmt::print(fmt::emphasis::bold | fg(fmt::color::red), "ERROR: unable to find baskets for: {}\n", id);
+        std::exit(1);
+      }
+
+      if (it->second.entry_size == 0 || !it->second.consistent)
+      {
+        fmt::print(fmt::emphasis::bold | fg(fmt::color::red), "ERROR: baskets of {} do not all hold whole entries of one size\n", id);
+        std::exit(1);
+      }
+
+      return it->second.entry_size;
+    }
+
+
     bool load_index() noexcept // need to do this once (scans more/or/less the root file )-; could store this to another file and reuse...
     {
       std::uint64_t pos = h_.fBEGIN;
@@ -759,6 +872,14 @@ namespace root {
         {
           auto& m = baskets_[std::string{t.Name}];
 
+          const auto entry_size = static_cast<std::uint32_t>(std::max(t.NevBufSize, 0));
+
+          // a basket of fixed size entries holds exactly NevBuf of them (otherwise ObjLen also covers an entry offset array)
+          if (m.cycles.empty())
+            m.entry_size = entry_size;
+
+          m.consistent &= entry_size == m.entry_size && static_cast<std::uint64_t>(std::max(t.NevBuf, 0)) * entry_size == t.ObjLen;
+
           m.cycles[t.Cycle] = { t.base, t.Nbytes };
           m.total_bytes    += t.ObjLen;
         }
@@ -789,6 +910,8 @@ namespace root {
     struct basket_info
     {
       std::uint64_t                total_bytes{0};           // total uncompressed bytes available for this (sum of all cycle TBasket's)
+      std::uint32_t                entry_size{0};            // bytes per entry (such as 8 for a double and 4 for a float), 0 if unknown
+      bool                         consistent{true};         // every basket holds whole entries of entry_size bytes
       std::map<int, std::pair<std::uint64_t, int>> cycles;   // map from cycle_id -> (offset_in_file, size of block)
     };
 
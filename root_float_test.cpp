@@ -0,0 +1,185 @@
+#include "root.hpp"
+
+#include "TFile.h"
+#include "TTree.h"
+#include "TLeaf.h"
+
+#include <fmt/format.h>
+#include <fmt/color.h>
+
+#include <vector>
+#include <span>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <cmath>
+#include <cstdlib>
+
+
+// Writes a tree with a float (/F) and a double (/D) branch, laid out as generate_recombinations lays out
+// cache/mass.root, then reads both back through root::file::uncompress_floating and checks every value survives
+//
+// Given a root file, the name of a tree in it and names of float or double branches of that tree (such as
+// cache/mass.root tree p_k_mu_mu), checks instead that uncompress_floating reads each branch as root itself does
+
+
+constexpr std::size_t entry_count{1'000'000}; // enough to spread each branch over many baskets
+
+constexpr const char* path{"cache/root_float_test.root"};
+
+
+void check(const bool ok, const std::string_view what)
+{
+  if (ok)
+    return;
+
+  fmt::print(fmt::emphasis::bold | fg(fmt::color::red), "ERROR: {}\n", what);
+  std::exit(1);
+}
+
+
+template<class T, class Stored>
+void check_values(const movency::root::file& r, const std::string_view name, const std::vector<Stored>& written)
+{
+  const std::vector<T> read = r.uncompress_floating<T>(name);
+
+  check(read.size() == written.size(), fmt::format("read {} entries of {} rather than {}", read.size(), name, written.size()));
+
+  for (std::size_t i = 0; i < written.size(); ++i)
+    check(read[i] == static_cast<T>(written[i]), fmt::format("entry {} of {} read as {} rather than {}", i, name, read[i], written[i]));
+}
+
+
+// values of a float or double branch as root reads them
+std::vector<double> read_with_root(TTree& tree, const std::string& name)
+{
+  TLeaf* const leaf = tree.GetLeaf(name.c_str());
+
+  check(leaf != nullptr, fmt::format("root finds no branch {}", name));
+
+  const std::string type{leaf->GetTypeName()};
+
+  check(type == "Float_t" || type == "Double_t", fmt::format("branch {} holds {} rather than floats or doubles", name, type));
+
+  float  float_val;
+  double double_val;
+
+  tree.SetBranchStatus("*", false);
+  tree.SetBranchStatus(name.c_str(), true);
+
+  if (type == "Float_t")
+    tree.SetBranchAddress(name.c_str(), &float_val);
+  else
+    tree.SetBranchAddress(name.c_str(), &double_val);
+
+  std::vector<double> out(static_cast<std::size_t>(tree.GetEntries()));
+
+  for (std::size_t i = 0; i < out.size(); ++i)
+  {
+    tree.GetEntry(static_cast<Long64_t>(i));
+
+    out[i] = type == "Float_t" ? static_cast<double>(float_val) : double_val;
+  }
+
+  tree.ResetBranchAddresses();
+
+  return out;
+}
+
+
+// checks each named branch of tree_name in file_path reads as root reads it
+int check_existing(const char* const file_path, const char* const tree_name, const std::span<char*> names)
+{
+  const auto input_file = std::make_unique<TFile>(file_path, "READ");
+
+  check(!input_file->IsZombie(), fmt::format("root is unable to open {}", file_path));
+
+  TTree* const tree = input_file->Get<TTree>(tree_name);
+
+  check(tree != nullptr, fmt::format("no tree {} in {}", tree_name, file_path));
+
+  const movency::root::file r(file_path);
+
+  check(r.ok(), fmt::format("unable to open root file: {}", file_path));
+
+  for (const std::string name : names)
+  {
+    check_values<double>(r, name, read_with_root(*tree, name));
+
+    fmt::print("{}: {} entries of {} bytes in {} baskets read as root reads them\n", name, r.get_entries(name), r.get_entry_size(name), r.get_basket_count(name));
+  }
+
+  fmt::print(fg(fmt::color::green), "{} branches of {} read intact\n", names.size(), file_path);
+
+  return EXIT_SUCCESS;
+}
+
+
+int main(int argc, char* argv[])
+{
+  if (argc > 1)
+  {
+    if (argc < 4)
+    {
+      fmt::print("usage: {} [file tree branch...]\n", argv[0]);
+      return EXIT_FAILURE;
+    }
+
+    return check_existing(argv[1], argv[2], std::span{argv + 3, static_cast<std::size_t>(argc - 3)});
+  }
+
+  // values spanning several orders of magnitude, with all their mantissa bits in use
+  std::vector<double> doubles(entry_count);
+  std::vector<float>  floats (entry_count);
+
+  for (std::size_t i = 0; i < entry_count; ++i)
+  {
+    doubles[i] = 1000.0 * std::sin(static_cast<double>(i)) * std::exp(static_cast<double>(i % 13) - 6.0);
+    floats [i] = static_cast<float>(doubles[i]);
+  }
+
+  {
+    const auto output_file = std::make_unique<TFile>(path, "RECREATE");
+    const auto output_tree = std::make_unique<TTree>("tree", "tree");
+
+    float  float_val;
+    double double_val;
+
+    output_tree->Branch("single", &float_val,  "single/F");
+    output_tree->Branch("double", &double_val, "double/D");
+
+    for (std::size_t i = 0; i < entry_count; ++i)
+    {
+      float_val  = floats [i];
+      double_val = doubles[i];
+
+      output_tree->Fill();
+    }
+
+    output_file->cd();
+    output_tree->Write();
+  }
+
+  const movency::root::file r(path);
+
+  check(r.ok(), fmt::format("unable to open root file: {}", path));
+
+  check(r.get_entry_size("single") == sizeof(float),  fmt::format("entries of single are {} bytes", r.get_entry_size("single")));
+  check(r.get_entry_size("double") == sizeof(double), fmt::format("entries of double are {} bytes", r.get_entry_size("double")));
+
+  check(r.get_entries("single") == entry_count, fmt::format("counted {} entries of single", r.get_entries("single")));
+  check(r.get_entries("double") == entry_count, fmt::format("counted {} entries of double", r.get_entries("double")));
+
+  // otherwise joining baskets back together goes untested
+  check(r.get_basket_count("single") > 1, fmt::format("single is held in {} basket(s)", r.get_basket_count("single")));
+  check(r.get_basket_count("double") > 1, fmt::format("double is held in {} basket(s)", r.get_basket_count("double")));
+
+  check_values<float> (r, "single", floats);
+  check_values<double>(r, "single", floats);
+  check_values<double>(r, "double", doubles);
+  check_values<float> (r, "double", doubles);
+
+  fmt::print(fg(fmt::color::green), "float and double branches of {} entries in {} and {} baskets read back intact\n", entry_count, r.get_basket_count("single"), r.get_basket_count("double"));
+
+  return EXIT_SUCCESS;
+}
@@ -1,3 +1,5 @@
+#pragma once
+
 #include <fmt/format.h>
 #include <fmt/compile.h>
 #include <fmt/color.h>
@@ -5,12 +7,17 @@
 #include <thread>
 #include <functional>
 #include <semaphore>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <vector>
+#include <algorithm>
 
 
 // Provides general threading infrastructure and helper functions
 //
 // The functions provided are do_threaded_without_pool, do_threaded, and loop_threaded
-// Constant thread_count is also provided
+// Constant thread_count and class work_sharing are also provided
 //
 // The thread_setup namespace should not be used elsewhere
 
@@ -18,16 +25,16 @@
 const std::size_t thread_count{std::max(1u, std::thread::hardware_concurrency() - 1)};
 //constexpr std::size_t thread_count{4};
 
-// create a thread for each core and run the given function on each
+// create a thread for each core (or thread_max of them) and run the given function on each
 // the function must take 0 arguments, or a single std::uint32_t,
-// in which case the thread number [0, thread_count - 1]  will be passed
-void do_threaded_without_pool(auto func)
+// in which case the thread number [0, thread_max - 1]  will be passed
+void do_threaded_without_pool(auto func, const std::size_t thread_max = thread_count)
 {
   std::vector<std::jthread> loop_threads{};
 
-  loop_threads.reserve(thread_count);
+  loop_threads.reserve(thread_max);
 
-  for (std::uint32_t thread_index = 0; thread_index < thread_count; ++thread_index)
+  for (std::uint32_t thread_index = 0; thread_index < thread_max; ++thread_index)
     if constexpr (std::invocable<decltype(func)>)
       loop_threads.emplace_back(func);
     else
@@ -176,3 +183,155 @@ bool register_terminate_threads_at_startup = []
 }();
 } // namespace thread_setup
 
+
+// Lets threads that have run out of work of their own help the others with theirs
+//
+// Each of worker_count threads splits its inner work into pieces with share(count, func), and calls done() once it has
+// no work of its own left; done() then runs pieces of other threads' shared work until every thread has called it.
+// While every thread is still busy, share() just runs the pieces itself (so sharing costs nothing until the work runs
+// out); as soon as a thread is idle it hands the remaining pieces out to the idle threads too (even part way through),
+// returning once every piece has run. Pieces should be coarse (a hundred microseconds or more, as handing one out costs
+// a few microseconds), and must not share work themselves. reset() readies it for another round, and must only be
+// called while no thread is using it (such as from the completion function of a barrier).
+class work_sharing
+{
+public:
+
+  explicit work_sharing(const std::size_t worker_count) noexcept
+    : workers_{worker_count}, active_{worker_count}
+  {
+  }
+
+  work_sharing(const work_sharing&) = delete;
+  work_sharing& operator=(const work_sharing&) = delete;
+
+  // call func(i) for each i in [0, count), possibly on other threads
+  void share(const std::size_t count, const std::function<void(std::size_t)>& func)
+  {
+    job j{func, count};
+
+    bool published{false};
+
+    // offer the remaining pieces to other threads once any are idle (until then, j is only seen by this thread)
+    auto publish_if_idle = [&]
+    {
+      if (active_.load(std::memory_order_relaxed) == workers_)
+        return;
+
+      {
+        const std::scoped_lock lock(mutex_);
+
+        jobs_.push_back(&j);
+      }
+
+      published = true;
+
+      changed_.notify_all();
+    };
+
+    if (count > 1)
+      publish_if_idle();
+
+    for (std::size_t i; (i = j.next.fetch_add(1, std::memory_order_relaxed)) < count;)
+    {
+      func(i);
+
+      if (published)
+        finish(j);
+      else
+      {
+        ++j.finished;
+
+        if (j.finished + 1 < count)
+          publish_if_idle();
+      }
+    }
+
+    if (!published)
+      return;
+
+    std::unique_lock lock(mutex_);
+
+    changed_.wait(lock, [&]{ return j.finished == count; });
+
+    std::erase(jobs_, &j);
+  }
+
+  // called by each thread once it has no work of its own left; helps the others until all have called it
+  void done()
+  {
+    {
+      const std::scoped_lock lock(mutex_);
+
+      active_.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    changed_.notify_all();
+
+    while (true)
+    {
+      job*        j{nullptr};
+      std::size_t i{0};
+
+      {
+        std::unique_lock lock(mutex_);
+
+        // a piece is claimed with the lock held, so its job cannot finish (and be destroyed) before it has run
+        changed_.wait(lock, [&]
+        {
+          for (job* const candidate : jobs_)
+            if ((i = candidate->next.fetch_add(1, std::memory_order_relaxed)) < candidate->count)
+            {
+              j = candidate;
+
+              return true;
+            }
+
+          return active_.load(std::memory_order_relaxed) == 0;
+        });
+
+        if (j == nullptr)
+          return;
+      }
+
+      j->func(i);
+
+      finish(*j);
+    }
+  }
+
+  void reset() noexcept
+  {
+    active_.store(workers_, std::memory_order_relaxed);
+  }
+
+private:
+
+  struct job
+  {
+    const std::function<void(std::size_t)>& func;
+    std::size_t                              count;
+    std::atomic<std::size_t>                 next{0};
+    std::size_t                              finished{0}; // guarded by mutex_ once the job is published
+  };
+
+  void finish(job& j)
+  {
+    bool last;
+
+    {
+      const std::scoped_lock lock(mutex_);
+
+      last = ++j.finished == j.count;
+    }
+
+    if (last)
+      changed_.notify_all();
+  }
+
+  const std::size_t        workers_;
+  std::atomic<std::size_t> active_;
+  std::mutex               mutex_;
+  std::condition_variable  changed_;
+  std::vector<job*>        jobs_;
+};